@@ -6,290 +6,4405 @@
  * - queues downloads so that jpg files are downloaded first
  *   (in case you shoot raw+jpg this will give you the viewable files faster,
  *   and the raw file is reordered for later download)
- * - renames downloads according to exif date
+ * - renames downloads according to exif date (read straight from the APP1
+ *   segment while the download starts, without building a libexif tree)
  * - rotates jpegs automatically (and handles exif similar as with exiftran)
+ * - optionally publishes the camera's embedded preview of each jpg first,
+ *   before downloading the full resolution file
+ * - optionally tethers all connected cameras at the same time
+ * - optionally writes a display size copy of each jpg, decoded at reduced
+ *   IDCT scale while the file is downloading
+ * - optionally writes a crc32c checksum manifest, computed while downloading
+ * - optionally notifies downstream tools of each published file via a
+ *   unix domain socket
+ * - optionally exposes pipeline metrics in prometheus text format
+ * - optionally mirrors the downloads to further directories (e.g. a usb stick
+ *   as backup), each with its own writer thread
+ * - optionally triggers captures on request from a command socket, and
+ *   reports the files of each shot with the latency since the trigger
+ * - optionally applies a profile of camera config settings after each init,
+ *   e.g. the capture target, to get the shots announced earlier
+ * - calls libgphoto2 for a camera only from the thread which tethers it;
+ *   other threads queue commands for it, which run in between its events and
+ *   downloads
+ * - optionally streams the live view of the camera into shared memory for a
+ *   display, in between the events and downloads
+ * - hands the jpg downloads to a fixed number of threads, so that memory
+ *   and threads stay bounded during long bursts
+ * - optionally smooths the writeback of the downloads (write-behind), so
+ *   that large raws do not stall the other writers on a slow SD card
+ * - optionally degrades under overload: jpgs are written as they are, and
+ *   rotated later when the backlog is gone
+ * - optionally rewrites the jpgs with optimized huffman tables (or
+ *   progressive) when the downloads are idle, losslessly
+ * - optionally extracts the embedded jpeg preview of raw files, so that raw-only
+ *   shooting gives a viewable file as fast as jpg shooting
+ * - optionally pins the camera after the first init, so that reconnects skip
+ *   the autodetection, and reconnects right on the usb hotplug event
+ * - optionally journals the downloads, and after a reconnect (or restart)
+ *   scans the camera for files which were added while it was disconnected
+ * - optionally keeps an index of all downloads, and skips the transfer of a
+ *   file which the camera offers again
+ * - can run against a simulated camera which replays a script of events,
+ *   for benchmarking the whole pipeline without a camera
+ * - optionally writes the downloads with io_uring, keeping several writes in
+ *   flight so that slow flash does not hold up the usb transfer
+ * - optionally records a chrome trace event timeline of all threads
+ * - optionally pins the usb, transform and worker threads to cpus and gives
+ *   them their own scheduling policy, so the usb link does not stall
+ * - optionally defers the deletion of downloaded files on the camera until
+ *   the event loop is idle (and the files are safely on disk)
  *
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <linux/netlink.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #include <gphoto2/gphoto2.h>
 #include <libexif/exif-data.h>
 #include <libraw/libraw.h>
 #include <libraw/libraw_version.h>
 #include "transupp/transupp.h"
+#include "simulatedCamera.h"
+#include "liveView.h"
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#endif
 
 char *receivedir;
-libraw_data_t *libraw;
+char *previewdir = NULL;
+char *derivativedir = NULL;
+int derivative_size = 1920;
+char *checksum_manifest = NULL;
+pthread_mutex_t manifest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* software trigger: "capture" requests on the command socket are queued as
+   commands for the tether threads, and the files of each shot are reported back to the
+   client which asked for it, with the latency since the trigger */
+#define TRIGGER_RING 64
+#define TRIGGER_FILES 4		/* e.g. jpg and raw of one shot */
+
+enum trigger_state {
+	TRIGGER_FREE,
+	TRIGGER_REQUESTED,	/* queued for the tether thread */
+	TRIGGER_FIRED,		/* waiting for the FILE_ADDED */
+	TRIGGER_SHOT,		/* the latest shot of the camera, more files of it may follow */
+	TRIGGER_RETIRED		/* a later shot has files, only the publishes are reported */
+};
+
+struct trigger {
+	enum trigger_state state;
+	int id;
+	int camera;		/* index of the tether camera */
+	int fd;			/* own dup of the client connection, -1 when none */
+	double requested_ms;
+	double triggered_ms;
+	char stem[128];		/* camera filename without the extension */
+	double added_ms[TRIGGER_FILES];	/* identifies the files of the shot when they are published */
+	int files;
+};
+
+char *command_socket = NULL;
+struct trigger triggers[TRIGGER_RING];
+int trigger_next = 0;
+int trigger_id = 0;
+pthread_mutex_t trigger_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* clients of the ready-file notification socket */
+struct notify_client {
+	int fd;
+	LIST_ENTRY(notify_client) entries;
+};
+char *notify_socket = NULL;
+LIST_HEAD(notify_head, notify_client) notify_clients = LIST_HEAD_INITIALIZER(notify_clients);
+pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* per stage latency histograms and counters, in prometheus text format */
+enum metrics_stage {
+	STAGE_EVENT_WAIT,
+	STAGE_TRANSFER,
+	STAGE_EXIF_SNIFF,
+	STAGE_TRANSFORM,
+	STAGE_WRITE,
+	STAGE_RENAME,
+	STAGE_DELETE,
+	STAGE_CATCH_UP,
+	STAGE_TRIGGER,
+	STAGE_COUNT
+};
+static const char *metrics_stage_names[STAGE_COUNT] = {
+	"event_wait", "transfer", "exif_sniff", "transform", "write", "rename", "delete", "catch_up", "trigger"
+};
+
+enum metrics_error {
+	ERROR_EVENT,
+	ERROR_DOWNLOAD,
+	ERROR_WRITE,
+	ERROR_DELETE,
+	ERROR_COUNT
+};
+static const char *metrics_error_names[ERROR_COUNT] = {
+	"event", "download", "write", "delete"
+};
+
+static const double metrics_buckets[] = {
+	0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10
+};
+#define METRICS_BUCKETS (sizeof(metrics_buckets)/sizeof(metrics_buckets[0]))
+
+struct metrics_histogram {
+	uint64_t buckets[METRICS_BUCKETS];	/* not cumulative, that is done when printing */
+	uint64_t count;
+	double sum;
+};
+
+struct metrics {
+	struct metrics_histogram stages[STAGE_COUNT];
+	uint64_t errors[ERROR_COUNT];
+	uint64_t downloaded_files;
+	uint64_t downloaded_bytes;
+	pthread_mutex_t mutex;
+};
+
+struct metrics metrics = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+char *metrics_socket = NULL;
+char *metrics_file = NULL;
+#define METRICS_FILE_INTERVAL 10
+
+/* trace spans are recorded into a buffer per thread without any locking,
+   and only collected when the trace is written */
+struct trace_event {
+	const char *name;
+	pid_t tid;
+	double start_ms;
+	double duration_ms;
+	char file[48];
+};
+#define TRACE_BUFFER_EVENTS 4096
+
+struct trace_buffer {
+	uint64_t head;		/* number of events ever recorded, the buffer wraps around */
+	pid_t tid;
+	char thread_name[32];
+	struct trace_buffer *next;	/* all buffers, never freed */
+	struct trace_buffer *next_free;
+	struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+char *trace_file = NULL;
+struct trace_buffer *trace_buffers = NULL;
+struct trace_buffer *trace_free_buffers = NULL;	/* of exited threads, for reuse */
+pthread_mutex_t trace_free_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;
+static __thread struct trace_buffer *trace_local = NULL;
+
+/* crc32c over the bytes which are written to the local file */
+struct stream_checksum {
+	uint32_t crc;
+	uint64_t size;
+};
+
+/* camera-side deletion which is deferred until the tether loop is idle,
+   so that the USB round trip of gp_camera_file_delete is not done between
+   two downloads of a burst */
+struct delete_entry {
+	struct delete_queue *queue;
+	CameraFilePath path;
+	int safe_on_disk;	/* only delete on camera once we have fsync'ed our copy */
+	int download_failed;
+	uint64_t size;		/* of the download */
+	char camera[160];	/* the camera it was downloaded from, see camera_identify */
+	int verify;		/* from the journal or an earlier connection: the camera (or its
+				   card) may have changed, so the file is checked before the delete */
+	int retries;		/* failed deletes */
+	TAILQ_ENTRY(delete_entry) entries;
+};
+
+#define DELETE_RETRIES 3
+
+struct delete_queue {
+	TAILQ_HEAD(delete_head, delete_entry) head;
+	pthread_mutex_t mutex;
+	char *journal;		/* persisted list of files which are safe to delete */
+	const char *camera;	/* of the current connection */
+	int safe_count;
+	/* metrics for the current burst */
+	int burst_files;
+	double burst_ms;
+};
+
+int deferred_delete = FALSE;
+int delete_batch_size = 10;
+#define DELETE_IDLE_TIMEOUT_MS 200
+
+/* journal of the downloads of one camera, so that the files which are added
+   while it is disconnected (or while we are not running) are found again by a
+   catch-up scan of the camera. one line per state change, the last one wins */
+#define JOURNAL_KNOWN 'K'	/* already on the camera before the first run, left alone */
+#define JOURNAL_PENDING 'P'	/* download queued */
+#define JOURNAL_DONE 'D'	/* downloaded */
+#define JOURNAL_DELETED 'X'	/* deleted on the camera, so the name can come again */
+
+struct journal_entry {
+	CameraFilePath path;
+	char state;
+	int seen;		/* found on the camera by the current scan */
+	int queued;		/* pending, and in the download queue of this connection (not
+				   just left over from a run or a connection which ended early) */
+	TAILQ_ENTRY(journal_entry) entries;
+};
+
+struct download_journal {
+	TAILQ_HEAD(journal_head, journal_entry) head;
+	char *filename;
+	FILE *f;
+	int existed;		/* FALSE on the very first run */
+};
+
+int catch_up = FALSE;
+int raw_preview = FALSE;
+
+/* overload degrade mode: when more than degrade_backlog jpgs are in flight or
+   files are queued, the rotation is deferred until the backlog is gone */
+struct rotation_job {
+	char *filename;
+	int transform;
+	double added_ms;
+	TAILQ_ENTRY(rotation_job) entries;
+};
+
+int degrade_backlog = 0;	/* 0: never degrade */
+int jpeg_inflight = 0;
+int deferred_rotations = 0;
+TAILQ_HEAD(rotation_head, rotation_job) rotation_queue = TAILQ_HEAD_INITIALIZER(rotation_queue);
+pthread_mutex_t rotation_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rotation_cond = PTHREAD_COND_INITIALIZER;
+#define DEGRADE_IDLE_POLL_MS 100
+
+/* idle-time optimization of the published jpgs: the same dct coefficients,
+   but with optimized huffman tables (and optionally progressive scans) */
+#define OPTIMIZE_HUFFMAN 1
+#define OPTIMIZE_PROGRESSIVE 2
+
+struct optimize_job {
+	char *filename;
+	int transform;		/* only for the notification, it is applied already */
+	double added_ms;
+	TAILQ_ENTRY(optimize_job) entries;
+};
+
+int optimize_mode = 0;		/* 0: do not optimize */
+char *optimize_dir = NULL;	/* NULL: replace the file in <receivepath> */
+int optimize_queue_depth = 0;
+uint64_t optimize_saved_bytes = 0;
+TAILQ_HEAD(optimize_head, optimize_job) optimize_queue = TAILQ_HEAD_INITIALIZER(optimize_queue);
+pthread_mutex_t optimize_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t optimize_cond = PTHREAD_COND_INITIALIZER;
+
+/* cpu affinity and scheduling policy per thread role: the usb link (tether
+   loop and the threads which drain the download streams), the jpeg transforms
+   and display copies, and the worker pool (renames, raw parsing) */
+enum thread_role {
+	ROLE_USB,
+	ROLE_TRANSFORM,
+	ROLE_WORKER,
+	ROLE_COUNT
+};
+static const char *thread_role_names[ROLE_COUNT] = {
+	"usb", "transform", "worker"
+};
+
+struct thread_policy {
+	int has_cpus;
+	cpu_set_t cpus;
+	int has_sched;
+	int policy;		/* SCHED_OTHER, SCHED_FIFO ... */
+	int priority;		/* for SCHED_FIFO and SCHED_RR */
+	int nice;		/* for SCHED_OTHER and SCHED_BATCH */
+	int warned;
+};
+
+struct thread_policy thread_policies[ROLE_COUNT];
+int thread_policies_used = FALSE;
+cpu_set_t default_cpus;
+int default_nice = 0;
+
+/* work for a camera from other threads: libgphoto2 is only called from the
+   tether thread of the camera, which runs the queued commands in between its
+   events and downloads, and hands back the result */
+enum camera_command_priority {
+	CAMERA_PRIORITY_HIGH,	/* before the next event or download, e.g. a trigger */
+	CAMERA_PRIORITY_IDLE	/* only when no downloads are waiting, e.g. config */
+};
+
+struct tether_camera;
+
+struct camera_command {
+	int (*func)(struct tether_camera *tc, void *arg);
+	void *arg;
+	enum camera_command_priority priority;
+	int retval;
+	int done;
+	TAILQ_ENTRY(camera_command) entries;
+};
+
+#define CAMERA_COMMAND_POLL_MS 20
+int camera_commands_used = FALSE;	/* when set, the event wait is kept short */
+
+/* one tethered camera, each with its own thread and context */
+struct tether_camera {
+	int index;
+	char *prefix;		/* prepended to the filenames, to keep several cameras apart */
+	char model[128];	/* empty when gp_camera_init shall autodetect */
+	char port[128];
+	char identity[160];	/* model and serial number (or port) of the connected camera */
+	Camera *camera;
+	GPContext *context;
+	struct delete_queue deletes;
+	struct download_journal journal;
+	int raw_queue_depth;
+	struct simulated_camera *sim;	/* instead of a real camera */
+	int pinned;		/* --pin-camera: abilities and port are known from the last init */
+	CameraAbilities pinned_abilities;
+	unsigned long hotplug_generation;	/* the last hotplug event which has been looked at */
+	int live_view;		/* FALSE when off, or not supported by the camera */
+	double live_view_next_ms;	/* when the next frame is due */
+	TAILQ_HEAD(camera_command_head, camera_command) commands;
+	int connected;
+	pthread_mutex_t commands_mutex;
+	pthread_cond_t commands_cond;
+	int shutter_num;	/* triggered shots since the last event latency report */
+	double shutter_sum;
+	pthread_t thread;
+};
+
+int multi_camera = FALSE;
+
+/* camera config profile: widgets (e.g. capturetarget) set after each init */
+struct camera_setting {
+	char *name;		/* widget name or label */
+	char *value;		/* text, choice (or its index), toggle or range value */
+};
+
+#define CAMERA_SETTINGS_MAX 32
+struct camera_setting camera_settings[CAMERA_SETTINGS_MAX];
+int camera_settings_num = 0;
+
+/* live view: the preview frames of the camera, captured in between the events
+   and downloads, and decoded (in another thread) into shared memory */
+double live_view_fps = 0;	/* 0: no live view */
+int live_view_size = 640;
+#define LIVE_VIEW_SIZE_MAX 8192	/* so that the slot offsets of the shm header stay within 32 bits */
+char *live_view_shm = LIVE_VIEW_DEFAULT_SHM;
+struct live_view_header *live_view = NULL;
+char *live_view_frame = NULL;	/* captured, waiting for the decoder */
+unsigned long live_view_frame_size;
+double live_view_frame_ms;
+pthread_mutex_t live_view_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t live_view_cond = PTHREAD_COND_INITIALIZER;
+struct tether_camera **cameras = NULL;
+int cameras_num = 0;		/* set last, when cameras is complete (see cameras_publish) */
+pthread_mutex_t cameras_mutex = PTHREAD_MUTEX_INITIALIZER;
+CameraAbilitiesList *abilities_list = NULL;
+GPPortInfoList *port_info_list = NULL;
+
+/* usb devices which are plugged in, from the kernel/udev netlink uevents */
+struct hotplug_device {
+	int vendor;
+	int product;
+	char port[32];		/* gphoto port path usb:BUS,DEV */
+};
+
+int pin_camera = FALSE;
+int hotplug_fd = -1;
+struct hotplug_device hotplug_last;
+unsigned long hotplug_generation = 0;
+pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+
+/* with a simulated camera, the event-to-publish latencies are collected
+   and reported when all scripted files are published */
+struct simulated_camera *simulated_camera = NULL;
+struct bench_latencies {
+	const char *type;
+	int download;	/* only the download publish of this type is measured */
+	double *ms;
+	int num;
+};
+struct bench_latencies bench[] = {
+	{ "jpg", TRUE, NULL, 0 }, { "raw", TRUE, NULL, 0 }, { "other", TRUE, NULL, 0 },
+	{ "preview", FALSE, NULL, 0 }, { "display", FALSE, NULL, 0 }
+};
+int bench_downloads = 0;	/* one per scripted event */
+int bench_downloads_done = FALSE;	/* report once the display copies are published too */
+#define BENCH_TYPES (int)(sizeof(bench)/sizeof(bench[0]))
+struct bench_latencies bench_transfer = { "transfer", TRUE, NULL, 0 };
+#define BENCH_IDLE_TIMEOUT_MS 30000
+#define BENCH_DRAIN_POLL_MS 10
+double bench_first_event_ms = -1;
+double bench_last_publish_ms = 0;
+pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* shared pool of worker threads for the processing after a download */
+struct work_item {
+	void *(*func)(void *);
+	void *arg;
+	TAILQ_ENTRY(work_item) entries;
+};
+
+struct work_pool {
+	TAILQ_HEAD(work_head, work_item) head;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct work_pool workers;
+
+/* what is known about a file when it appears under its final name */
+struct published_file {
+	const char *path;
+	const char *type;	/* jpg, raw, other, preview or display */
+	int width;		/* 0 when unknown */
+	int height;
+	int transform;		/* the rotation which has been applied */
+	double added_ms;	/* when the camera announced the file */
+	double transfer_ms;	/* 0 when there was no download for this file */
+	struct stream_checksum *sum;	/* NULL when there is no checksum */
+	int download;		/* the first publish of a downloaded file (jpg, raw, other), not a
+				   derived file or a republish after a deferred rotation */
+};
+
+struct rename_info {
+	char *filename;
+	const char *prefix;
+	struct stream_checksum sum;
+	double added_ms;
+	double transfer_ms;
+};
+
+/* in-memory copy of a download stream, for a second consumer which must never
+   slow down the download itself (the writer only appends, and never blocks) */
+struct stream_chunk {
+	size_t size;
+	STAILQ_ENTRY(stream_chunk) entries;
+	unsigned char data[];
+};
+
+struct stream_buffer {
+	STAILQ_HEAD(stream_chunk_head, stream_chunk) head;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/* io_uring for the writes of a download: the data is copied into one of a
+   few (registered) buffers, and the write of a full buffer is only submitted,
+   not waited for. only when all buffers are in flight, the writer waits.
+   the rings are set up once, and handed from one download to the next */
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE (128 * 1024)
+
+#ifdef HAVE_IO_URING
+struct uring_writer {
+	int ring_fd;
+	int fd;
+	int registered;		/* WRITE_FIXED with registered buffers, else WRITEV */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned char *buffers;
+	struct iovec iov[URING_BUFFERS];	/* what is left to write of each buffer */
+	off_t offset[URING_BUFFERS];
+	int free_buf[URING_BUFFERS];
+	int free_num;
+	int current;		/* the buffer being filled, -1 if none */
+	size_t fill;
+	off_t next_offset;
+	int inflight;
+	int failed;
+	struct uring_writer *next_free;
+};
+
+struct uring_writer *uring_free_writers = NULL;	/* of finished downloads, for reuse */
+pthread_mutex_t uring_free_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int io_uring_writes = FALSE;	/* cleared by the first download which cannot set up a ring */
+
+/* write-behind: the writeback of each completed window of a download is
+   started right away, so that dirty pages do not pile up until the kernel
+   flushes them in a burst, which stalls all other writers */
+uint64_t write_behind_window = 0;	/* bytes, 0: off */
+
+/* a further receive directory, which gets a copy of each downloaded file.
+   each one has its own queue and thread, so a slow device only lags behind */
+struct mirror_job {
+	char *path;
+	int replace;		/* published again (rotated or optimized), replaces the earlier copy */
+	double queued_ms;
+	TAILQ_ENTRY(mirror_job) entries;
+};
+
+/* a copy which did not get the name of its file, because the name was taken
+   in the mirror directory already (e.g. by an earlier session) */
+struct mirror_name {
+	char *path;
+	char *dest;
+	LIST_ENTRY(mirror_name) entries;
+};
+
+struct mirror {
+	char *dir;
+	TAILQ_HEAD(mirror_head, mirror_job) jobs;
+	LIST_HEAD(mirror_name_head, mirror_name) names;	/* only used by the mirror thread */
+	int depth;
+	uint64_t files;
+	uint64_t errors;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct mirror **mirrors = NULL;
+int mirrors_num = 0;
+
+/* index of the files downloaded so far, to recognize a file which the camera
+   offers again (e.g. a card which is not wiped, or a second catch-up) without
+   transferring it. it is hashed by the filename, so that a name which has
+   never been downloaded does not cost a usb round trip */
+#define DEDUP_BUCKETS 4096
+#define DEDUP_HEAD_SIZE (64 * 1024)
+
+struct dedup_key {
+	char name[160];		/* camera prefix and filename, empty when not indexed */
+	uint64_t size;		/* of the download */
+};
+
+struct dedup_entry {
+	struct dedup_key key;
+	struct stream_checksum head;
+	struct dedup_entry *next;
+};
+
+int skip_duplicates = FALSE;
+struct dedup_entry *dedup_index[DEDUP_BUCKETS];
+FILE *dedup_file = NULL;
+pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t duplicates_skipped = 0;
+
+/* writes the download stream to the local file */
+struct download_writer {
+	int fd;
+	int hash;		/* FALSE when the stream is not the final file content (e.g. transformed later) */
+	int failed;
+	struct stream_checksum sum;
+	struct stream_checksum head;	/* of the first DEDUP_HEAD_SIZE bytes, for the duplicate index */
+	uint64_t bytes;
+	double write_ms;	/* time spent in write() */
+	struct stream_buffer *tee;
+	struct uring_writer *uring;	/* NULL for plain write() */
+	int write_behind;	/* a regular file, with --write-behind */
+	int drop_cache;		/* drop the written pages (but the first window), e.g. of raws */
+	uint64_t flushed;	/* the writeback has been started up to here */
+};
+
+struct jpeg_info {
+	char camerafilename[sizeof(((CameraFilePath *)0)->name)];
+	const char *prefix;
+	int fd_from_gphoto;
+	FILE *src;
+	FILE *dest;
+	int transform;
+	struct stream_checksum sum;
+	double added_ms;
+	double start_ms;
+	char *localFilename;	/* preset when the name is already known (and reserved) */
+	struct delete_entry *delete_entry;
+	struct dedup_key dedup;
+	int download_failed;	/* set by the tether loop before it closes the pipe */
+};
+
+/* the jpg downloads are handed from the tether loops to a fixed set of
+   threads, each with its own preallocated jpeg_info. when all of them are
+   busy, the tether loop either waits (block), or queues the jpg in front of
+   the raws (spill), to be downloaded when the camera is idle */
+#define JPEG_FULL_BLOCK 0
+#define JPEG_FULL_SPILL 1
+
+struct jpeg_pool {
+	int num;
+	struct jpeg_info *infos;
+	struct jpeg_info **free_infos;	/* stack of the descriptors not in use */
+	int free_num;
+	struct jpeg_info **ring;	/* handed over, but not picked up by a thread yet */
+	int ring_head;
+	int ring_num;
+	uint64_t full;			/* how often a tether loop found all threads busy */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_free;
+};
+
+int jpeg_threads = 4;
+int jpeg_full_policy = JPEG_FULL_BLOCK;
+struct jpeg_pool jpeg_pool;
+
+/* names which are handed out by unique_filename but not yet created on disk */
+struct reserved_name {
+	char *filename;
+	LIST_ENTRY(reserved_name) entries;
+};
+LIST_HEAD(reserved_head, reserved_name) reserved_names = LIST_HEAD_INITIALIZER(reserved_names);
+pthread_mutex_t reserved_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the tether cameras, for the threads which already run during the detection
+   (metrics, command socket ...). 0 until the array is complete */
+static int cameras_count(void) {
+	return __atomic_load_n(&cameras_num, __ATOMIC_ACQUIRE);
+}
+
+static void cameras_publish(struct tether_camera **list, int num) {
+	pthread_mutex_lock(&cameras_mutex);
+	cameras = list;
+	__atomic_store_n(&cameras_num, num, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cameras_mutex);
+}
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* copy a string for use inside a json string value */
+static char *json_escape(const char *in, char *out, size_t outsize) {
+	char *p = out;
+
+	for(; *in != '\0' && p < &out[outsize-3]; in++) {
+		if(*in == '"' || *in == '\\') {
+			*p++ = '\\';
+		}
+		*p++ = ((unsigned char) *in < 0x20) ? '?' : *in;
+	}
+	*p = '\0';
+	return out;
+}
+
+static void trace_thread_exit(void *arg) {
+	struct trace_buffer *tb = (struct trace_buffer *) arg;
+
+	pthread_mutex_lock(&trace_free_mutex);
+	tb->next_free = trace_free_buffers;
+	trace_free_buffers = tb;
+	pthread_mutex_unlock(&trace_free_mutex);
+}
+
+static struct trace_buffer *trace_thread_buffer(void) {
+	struct trace_buffer *tb = trace_local;
+
+	if(tb != NULL) {
+		return tb;
+	}
+	/* threads come and go with every download, so the buffers are recycled */
+	pthread_mutex_lock(&trace_free_mutex);
+	tb = trace_free_buffers;
+	if(tb != NULL) {
+		trace_free_buffers = tb->next_free;
+	}
+	pthread_mutex_unlock(&trace_free_mutex);
+	if(tb == NULL) {
+		tb = calloc(1, sizeof(struct trace_buffer));
+		tb->next = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+		while(!__atomic_compare_exchange_n(&trace_buffers, &tb->next, tb, FALSE, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	}
+	tb->tid = syscall(SYS_gettid);
+	tb->thread_name[0] = '\0';
+	pthread_setspecific(trace_key, tb);
+	trace_local = tb;
+	return tb;
+}
+
+static void trace_thread_name(const char *name, const char *suffix) {
+	if(trace_file != NULL) {
+		snprintf(trace_thread_buffer()->thread_name, sizeof(trace_local->thread_name), "%s%s", name, suffix);
+	}
+}
+
+static double trace_begin(void) {
+	return (trace_file != NULL) ? now_ms() : 0;
+}
+
+static void trace_end(const char *name, const char *file, double start_ms) {
+	struct trace_buffer *tb;
+	struct trace_event *ev;
+	uint64_t head;
+
+	if(trace_file == NULL) {
+		return;
+	}
+	tb = trace_thread_buffer();
+	head = tb->head;
+	ev = &tb->events[head % TRACE_BUFFER_EVENTS];
+	ev->name = name;
+	ev->tid = tb->tid;
+	ev->start_ms = start_ms;
+	ev->duration_ms = now_ms() - start_ms;
+	snprintf(ev->file, sizeof(ev->file), "%s", (file != NULL) ? file : "");
+	__atomic_store_n(&tb->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write all recorded spans in chrome trace event format (chrome://tracing, ui.perfetto.dev) */
+static void trace_write(void) {
+	struct trace_buffer *tb;
+	struct trace_event *ev;
+	uint64_t head, i;
+	char file[2 * sizeof(ev->file)];
+	char *tmpFilename;
+	const char *sep = "";
+	pid_t pid = getpid();
+	FILE *f;
+
+	tmpFilename = malloc(strlen(trace_file) + 6);
+	sprintf(tmpFilename, "%s.part", trace_file);
+	f = fopen(tmpFilename, "w");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot write trace file %s\n", tmpFilename);
+		free(tmpFilename);
+		return;
+	}
+	fprintf(f, "{\"traceEvents\":[");
+	for(tb = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); tb != NULL; tb = tb->next) {
+		head = __atomic_load_n(&tb->head, __ATOMIC_ACQUIRE);
+		if(tb->thread_name[0] != '\0') {
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				sep, pid, tb->tid, tb->thread_name);
+			sep = ",";
+		}
+		for(i = (head > TRACE_BUFFER_EVENTS) ? head - TRACE_BUFFER_EVENTS : 0; i < head; i++) {
+			ev = &tb->events[i % TRACE_BUFFER_EVENTS];
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%d,\"args\":{\"file\":\"%s\"}}",
+				sep, ev->name, ev->start_ms * 1000.0, ev->duration_ms * 1000.0, pid, ev->tid,
+				json_escape(ev->file, file, sizeof(file)));
+			sep = ",";
+		}
+	}
+	fprintf(f, "\n]}\n");
+	if(fclose(f) == 0 && rename(tmpFilename, trace_file) == 0) {
+		printf("Trace written to %s\n", trace_file);
+	} else {
+		fprintf(stderr, "Cannot write trace file %s\n", trace_file);
+	}
+	free(tmpFilename);
+}
+
+/* SIGUSR1 writes the trace, SIGINT/SIGTERM write it and exit */
+static void *trace_signal_threadfunc(void *arg) {
+	sigset_t *sigs = (sigset_t *) arg;
+	int sig;
+
+	while(TRUE) {
+		if(sigwait(sigs, &sig) != 0) {
+			continue;
+		}
+		trace_write();
+		if(sig != SIGUSR1) {
+			exit(0);
+		}
+	}
+	return NULL;
+}
+
+/* must be called before any other thread is started, so that they all inherit the signal mask */
+static void trace_start(void) {
+	static sigset_t sigs;
+	pthread_t thread;
+
+	pthread_key_create(&trace_key, &trace_thread_exit);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	pthread_create(&thread, NULL, &trace_signal_threadfunc, &sigs);
+	pthread_detach(thread);
+}
+
+static int thread_role_lookup(const char *name, size_t len) {
+	int i;
+
+	for(i=0; i<ROLE_COUNT; i++) {
+		if(strlen(thread_role_names[i]) == len && strncmp(thread_role_names[i], name, len) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* ROLE=CPULIST, e.g. usb=0 or transform=1-3,5 */
+static int parse_thread_cpus(const char *arg) {
+	const char *eq = strchr(arg, '=');
+	const char *p;
+	char *end;
+	long from, to;
+	int role;
+
+	if(eq == NULL || (role = thread_role_lookup(arg, eq - arg)) < 0) {
+		return FALSE;
+	}
+	CPU_ZERO(&thread_policies[role].cpus);
+	for(p = eq+1; *p != '\0'; p = end) {
+		from = to = strtol(p, &end, 10);
+		if(end == p || from < 0) {
+			return FALSE;
+		}
+		if(*end == '-') {
+			p = end+1;
+			to = strtol(p, &end, 10);
+			if(end == p || to < from) {
+				return FALSE;
+			}
+		}
+		for(; from <= to && from < CPU_SETSIZE; from++) {
+			CPU_SET(from, &thread_policies[role].cpus);
+		}
+		if(*end == ',') {
+			end++;
+		} else if(*end != '\0') {
+			return FALSE;
+		}
+	}
+	thread_policies[role].has_cpus = TRUE;
+	thread_policies_used = TRUE;
+	return TRUE;
+}
+
+/* ROLE=POLICY with POLICY one of fifo:PRIO, rr:PRIO, nice:N, batch, idle */
+static int parse_thread_sched(const char *arg) {
+	const char *eq = strchr(arg, '=');
+	struct thread_policy *tp;
+	int role;
+
+	if(eq == NULL || (role = thread_role_lookup(arg, eq - arg)) < 0) {
+		return FALSE;
+	}
+	tp = &thread_policies[role];
+	tp->priority = 0;
+	tp->nice = 0;
+	if(sscanf(eq+1, "fifo:%d", &tp->priority) == 1) {
+		tp->policy = SCHED_FIFO;
+	} else if(sscanf(eq+1, "rr:%d", &tp->priority) == 1) {
+		tp->policy = SCHED_RR;
+	} else if(sscanf(eq+1, "nice:%d", &tp->nice) == 1) {
+		tp->policy = SCHED_OTHER;
+	} else if(strcmp(eq+1, "batch") == 0) {
+		tp->policy = SCHED_BATCH;
+	} else if(strcmp(eq+1, "idle") == 0) {
+		tp->policy = SCHED_IDLE;
+	} else {
+		return FALSE;
+	}
+	tp->has_sched = TRUE;
+	thread_policies_used = TRUE;
+	return TRUE;
+}
+
+/* called by each thread when it starts. a role without settings gets the
+   defaults of the process, rather than what it inherits from its creator */
+static void thread_role(enum thread_role role) {
+	struct thread_policy *tp = &thread_policies[role];
+	struct sched_param param;
+	pid_t tid;
+	int ok = TRUE;
+
+	if(!thread_policies_used) {
+		return;
+	}
+	tid = syscall(SYS_gettid);
+	if(sched_setaffinity(tid, sizeof(cpu_set_t), tp->has_cpus ? &tp->cpus : &default_cpus) != 0) {
+		ok = FALSE;
+	}
+	memset(&param, 0, sizeof(param));
+	if(tp->has_sched && (tp->policy == SCHED_FIFO || tp->policy == SCHED_RR)) {
+		param.sched_priority = tp->priority;
+		ok = (sched_setscheduler(tid, tp->policy, &param) == 0) && ok;
+	} else {
+		ok = (sched_setscheduler(tid, tp->has_sched ? tp->policy : SCHED_OTHER, &param) == 0) && ok;
+		ok = (setpriority(PRIO_PROCESS, tid, tp->has_sched ? tp->nice : default_nice) == 0) && ok;
+	}
+	if(!ok && !tp->warned) {
+		tp->warned = TRUE;	/* once per role is enough */
+		fprintf(stderr, "Cannot set cpu affinity or scheduling policy of the %s threads: %s\n",
+			thread_role_names[role], strerror(errno));
+	}
+}
+
+static void metrics_observe(enum metrics_stage stage, double ms) {
+	struct metrics_histogram *h = &metrics.stages[stage];
+	double seconds = ms / 1000.0;
+	int i;
+
+	pthread_mutex_lock(&metrics.mutex);
+	for(i=0; i<METRICS_BUCKETS; i++) {
+		if(seconds <= metrics_buckets[i]) {
+			h->buckets[i]++;
+			break;
+		}
+	}
+	h->count++;
+	h->sum += seconds;
+	pthread_mutex_unlock(&metrics.mutex);
+}
+
+static void metrics_error(enum metrics_error error) {
+	pthread_mutex_lock(&metrics.mutex);
+	metrics.errors[error]++;
+	pthread_mutex_unlock(&metrics.mutex);
+}
+
+static void metrics_download(uint64_t bytes) {
+	pthread_mutex_lock(&metrics.mutex);
+	metrics.downloaded_files++;
+	metrics.downloaded_bytes += bytes;
+	pthread_mutex_unlock(&metrics.mutex);
+}
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+	uint32_t crc;
+	int i, j;
+
+	for(i=0; i<256; i++) {
+		crc = i;
+		for(j=0; j<8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for(i=0; i<256; i++) {
+		for(j=1; j<8; j++) {
+			crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+		}
+	}
+}
+#endif
+
+/* crc32c (castagnoli), using the cpu's crc instructions when compiled for them
+   (e.g. -msse4.2 or -march=armv8-a+crc), else slicing-by-8 */
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *buf, size_t len) {
+	crc = ~crc;
+#if defined(__SSE4_2__)
+	for(; len > 0 && ((uintptr_t) buf & 7) != 0; len--) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	for(; len >= 8; len -= 8, buf += 8) {
+#if defined(__x86_64__)
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc = (uint32_t) _mm_crc32_u64(crc, v);
+#else
+		uint32_t v[2];
+		memcpy(v, buf, 8);
+		crc = _mm_crc32_u32(_mm_crc32_u32(crc, v[0]), v[1]);
+#endif
+	}
+	for(; len > 0; len--) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+#elif defined(__ARM_FEATURE_CRC32)
+	for(; len > 0 && ((uintptr_t) buf & 3) != 0; len--) {
+		crc = __crc32cb(crc, *buf++);
+	}
+	for(; len >= 4; len -= 4, buf += 4) {
+		uint32_t v;
+		memcpy(&v, buf, 4);
+		crc = __crc32cw(crc, v);
+	}
+	for(; len > 0; len--) {
+		crc = __crc32cb(crc, *buf++);
+	}
+#else
+	pthread_once(&crc32c_table_once, crc32c_init_table);
+	for(; len >= 8; len -= 8, buf += 8) {
+		crc ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+		crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff] ^
+		      crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24] ^
+		      crc32c_table[3][buf[4]] ^ crc32c_table[2][buf[5]] ^
+		      crc32c_table[1][buf[6]] ^ crc32c_table[0][buf[7]];
+	}
+	for(; len > 0; len--) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+	}
+#endif
+	return ~crc;
+}
+
+static void checksum_update(struct stream_checksum *sum, const unsigned char *buf, size_t len) {
+	sum->crc = crc32c_update(sum->crc, buf, len);
+	sum->size += len;
+}
+
+/* drop the line of a file from the checksum manifest, by rewriting it. only
+   with the manifest_mutex */
+static void manifest_remove(const char *base) {
+	char line[512], *tmpFilename;
+	FILE *in, *out;
+	int pos;
+
+	in = fopen(checksum_manifest, "r");
+	if(in == NULL) {
+		return;
+	}
+	tmpFilename = malloc(strlen(checksum_manifest) + 6);
+	sprintf(tmpFilename, "%s.part", checksum_manifest);
+	out = fopen(tmpFilename, "w");
+	if(out == NULL) {
+		fprintf(stderr, "Cannot write checksum manifest %s\n", tmpFilename);
+		fclose(in);
+		free(tmpFilename);
+		return;
+	}
+	while(fgets(line, sizeof(line), in) != NULL) {
+		pos = -1;
+		sscanf(line, "%*x %*u %n", &pos);
+		if(pos > 0 && strcspn(line + pos, "\n") == strlen(base) && strncmp(line + pos, base, strlen(base)) == 0) {
+			continue;
+		}
+		fputs(line, out);
+	}
+	fclose(in);
+	if(fclose(out) != 0 || rename(tmpFilename, checksum_manifest) != 0) {
+		fprintf(stderr, "Cannot write checksum manifest %s\n", checksum_manifest);
+	}
+	free(tmpFilename);
+}
+
+/* add the published file to the checksum manifest. a file which is published
+   again (after its deferred rotation or optimization) replaces its line */
+static void manifest_append(const char *filename, struct stream_checksum *sum, int replace) {
+	const char *base;
+	FILE *f;
+
+	if(checksum_manifest == NULL) {
+		return;
+	}
+	base = strrchr(filename, '/');
+	base = (base != NULL) ? base+1 : filename;
+	pthread_mutex_lock(&manifest_mutex);
+	if(replace) {
+		manifest_remove(base);
+	}
+	f = fopen(checksum_manifest, "a");
+	if(f != NULL) {
+		fprintf(f, "%08x  %llu  %s\n", sum->crc, (unsigned long long) sum->size, base);
+		fclose(f);
+	} else {
+		fprintf(stderr, "Cannot write checksum manifest %s\n", checksum_manifest);
+	}
+	pthread_mutex_unlock(&manifest_mutex);
+}
+
+static struct stream_buffer *stream_buffer_new(void) {
+	struct stream_buffer *sb = malloc(sizeof(struct stream_buffer));
+	STAILQ_INIT(&sb->head);
+	sb->closed = FALSE;
+	pthread_mutex_init(&sb->mutex, NULL);
+	pthread_cond_init(&sb->cond, NULL);
+	return sb;
+}
+
+static void stream_buffer_append(struct stream_buffer *sb, const unsigned char *buf, size_t len) {
+	struct stream_chunk *chunk;
+	int closed;
+
+	pthread_mutex_lock(&sb->mutex);
+	closed = sb->closed;
+	pthread_mutex_unlock(&sb->mutex);
+	if(closed) {
+		return;		/* the reader is finished already */
+	}
+	chunk = malloc(sizeof(struct stream_chunk) + len);
+	chunk->size = len;
+	memcpy(chunk->data, buf, len);
+	pthread_mutex_lock(&sb->mutex);
+	STAILQ_INSERT_TAIL(&sb->head, chunk, entries);
+	pthread_cond_signal(&sb->cond);
+	pthread_mutex_unlock(&sb->mutex);
+}
+
+static void stream_buffer_close(struct stream_buffer *sb) {
+	pthread_mutex_lock(&sb->mutex);
+	sb->closed = TRUE;
+	pthread_cond_signal(&sb->cond);
+	pthread_mutex_unlock(&sb->mutex);
+}
+
+/* waits for the next chunk, NULL at the end of the stream. the caller frees the chunk */
+static struct stream_chunk *stream_buffer_next(struct stream_buffer *sb) {
+	struct stream_chunk *chunk;
+
+	pthread_mutex_lock(&sb->mutex);
+	while(sb->head.stqh_first == NULL && !sb->closed) {
+		pthread_cond_wait(&sb->cond, &sb->mutex);
+	}
+	chunk = sb->head.stqh_first;
+	if(chunk != NULL) {
+		STAILQ_REMOVE_HEAD(&sb->head, entries);
+	}
+	pthread_mutex_unlock(&sb->mutex);
+	return chunk;
+}
+
+static void stream_buffer_free(struct stream_buffer *sb) {
+	struct stream_chunk *chunk;
+
+	while((chunk = sb->head.stqh_first) != NULL) {
+		STAILQ_REMOVE_HEAD(&sb->head, entries);
+		free(chunk);
+	}
+	pthread_mutex_destroy(&sb->mutex);
+	pthread_cond_destroy(&sb->cond);
+	free(sb);
+}
+
+static void *notify_accept_threadfunc(void *arg) {
+	int listenfd = *(int *) arg;
+	struct notify_client *client;
+	int fd;
+
+	while(TRUE) {
+		fd = accept(listenfd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Notification socket accept error: %s\n", strerror(errno));
+			break;
+		}
+		client = malloc(sizeof(struct notify_client));
+		client->fd = fd;
+		pthread_mutex_lock(&notify_mutex);
+		LIST_INSERT_HEAD(&notify_clients, client, entries);
+		pthread_mutex_unlock(&notify_mutex);
+	}
+	return NULL;
+}
+
+static int unix_socket_listen(const char *path);
+
+static int notify_start(const char *path) {
+	static int listenfd;
+	pthread_t thread;
+
+	listenfd = unix_socket_listen(path);
+	if(listenfd < 0) {
+		return FALSE;
+	}
+	pthread_create(&thread, NULL, &notify_accept_threadfunc, &listenfd);
+	pthread_detach(thread);
+	return TRUE;
+}
+
+static const char *transform_name(int transform) {
+	switch(transform) {
+		case JXFORM_FLIP_H:	return "flip-h";
+		case JXFORM_FLIP_V:	return "flip-v";
+		case JXFORM_TRANSPOSE:	return "transpose";
+		case JXFORM_TRANSVERSE:	return "transverse";
+		case JXFORM_ROT_90:	return "rot-90";
+		case JXFORM_ROT_180:	return "rot-180";
+		case JXFORM_ROT_270:	return "rot-270";
+		default:	return "none";
+	}
+}
+
+/* one json line per published file, to every connected client. clients which
+   do not keep up lose records rather than slowing down the downloads */
+static void notify_published(struct published_file *pf) {
+	struct notify_client *client, *next;
+	char record[2 * PATH_MAX + 512];
+	char path[2 * PATH_MAX];
+	ssize_t sent;
+	int len;
+
+	json_escape(pf->path, path, sizeof(path));
+	len = snprintf(record, sizeof(record),
+		"{\"path\":\"%s\",\"type\":\"%s\",\"width\":%d,\"height\":%d,\"orientation\":\"%s\",\"latency_ms\":%.1f,\"transfer_ms\":%.1f}\n",
+		path, pf->type, pf->width, pf->height, transform_name(pf->transform),
+		now_ms() - pf->added_ms, pf->transfer_ms);
+	if(len >= sizeof(record)) {
+		return;
+	}
+
+	pthread_mutex_lock(&notify_mutex);
+	for(client = notify_clients.lh_first; client != NULL; client = next) {
+		next = client->entries.le_next;
+		sent = send(client->fd, record, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		/* a full socket loses the whole line. after a part of a line, the
+		   stream is torn, so the client is dropped */
+		if((sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (sent >= 0 && sent < len)) {
+			close(client->fd);
+			LIST_REMOVE(client, entries);
+			free(client);
+		}
+	}
+	pthread_mutex_unlock(&notify_mutex);
+}
+
+/* one json line to the client of a trigger. the caller holds trigger_mutex */
+static void trigger_reply(struct trigger *t, const char *format, ...) {
+	char record[2 * PATH_MAX + 256];
+	va_list args;
+	ssize_t sent;
+	int len;
+
+	if(t->fd < 0) {
+		return;
+	}
+	va_start(args, format);
+	len = vsnprintf(record, sizeof(record), format, args);
+	va_end(args);
+	if(len >= sizeof(record)) {
+		return;
+	}
+	sent = send(t->fd, record, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(sent >= 0 && sent < len) {
+		/* a torn line: drop the connection, which the other triggers of the
+		   client share */
+		shutdown(t->fd, SHUT_RDWR);
+	}
+	if((sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (sent >= 0 && sent < len)) {
+		close(t->fd);
+		t->fd = -1;
+	}
+}
+
+/* queue a command for the tether thread of the camera. when the camera is
+   not connected, the command fails right away */
+static void camera_command_submit(struct tether_camera *tc, struct camera_command *cmd) {
+	struct camera_command *c;
+
+	cmd->done = FALSE;
+	pthread_mutex_lock(&tc->commands_mutex);
+	if(!tc->connected) {
+		cmd->retval = GP_ERROR_IO;
+		cmd->done = TRUE;
+	} else if(cmd->priority == CAMERA_PRIORITY_HIGH) {
+		/* behind the other high priority commands, but before the idle ones */
+		for(c = tc->commands.tqh_first; c != NULL && c->priority == CAMERA_PRIORITY_HIGH; c = c->entries.tqe_next);
+		if(c != NULL) {
+			TAILQ_INSERT_BEFORE(c, cmd, entries);
+		} else {
+			TAILQ_INSERT_TAIL(&tc->commands, cmd, entries);
+		}
+	} else {
+		TAILQ_INSERT_TAIL(&tc->commands, cmd, entries);
+	}
+	pthread_mutex_unlock(&tc->commands_mutex);
+}
+
+static int camera_command_wait(struct tether_camera *tc, struct camera_command *cmd) {
+	pthread_mutex_lock(&tc->commands_mutex);
+	while(!cmd->done) {
+		pthread_cond_wait(&tc->commands_cond, &tc->commands_mutex);
+	}
+	pthread_mutex_unlock(&tc->commands_mutex);
+	return cmd->retval;
+}
+
+/* run func(tc, arg) on the tether thread of the camera, and wait for it */
+static int camera_call(struct tether_camera *tc, enum camera_command_priority priority, int (*func)(struct tether_camera *, void *), void *arg) {
+	struct camera_command cmd;
+
+	cmd.func = func;
+	cmd.arg = arg;
+	cmd.priority = priority;
+	camera_command_submit(tc, &cmd);
+	return camera_command_wait(tc, &cmd);
+}
+
+/* run the queued commands, the idle ones only when no downloads are waiting.
+   only call from the tether loop */
+static void camera_commands_run(struct tether_camera *tc, int idle) {
+	struct camera_command *cmd;
+	int retval;
+
+	pthread_mutex_lock(&tc->commands_mutex);
+	while((cmd = tc->commands.tqh_first) != NULL && (idle || cmd->priority == CAMERA_PRIORITY_HIGH)) {
+		TAILQ_REMOVE(&tc->commands, cmd, entries);
+		pthread_mutex_unlock(&tc->commands_mutex);
+
+		retval = cmd->func(tc, cmd->arg);
+
+		pthread_mutex_lock(&tc->commands_mutex);
+		cmd->retval = retval;
+		cmd->done = TRUE;
+		pthread_cond_broadcast(&tc->commands_cond);
+	}
+	pthread_mutex_unlock(&tc->commands_mutex);
+}
+
+/* while the camera is gone, the commands for it fail instead of waiting */
+static void camera_commands_connected(struct tether_camera *tc, int connected) {
+	struct camera_command *cmd;
+
+	pthread_mutex_lock(&tc->commands_mutex);
+	tc->connected = connected;
+	while(!connected && (cmd = tc->commands.tqh_first) != NULL) {
+		TAILQ_REMOVE(&tc->commands, cmd, entries);
+		cmd->retval = GP_ERROR_IO;
+		cmd->done = TRUE;
+	}
+	pthread_cond_broadcast(&tc->commands_cond);
+	pthread_mutex_unlock(&tc->commands_mutex);
+}
+
+/* a new trigger record for one camera, the oldest ones are reused. the
+   caller holds trigger_mutex */
+static struct trigger *trigger_new(int fd, int camera) {
+	struct trigger *t = &triggers[trigger_next];
+
+	trigger_next = (trigger_next + 1) % TRIGGER_RING;
+	if(t->state != TRIGGER_FREE && t->fd >= 0) {
+		close(t->fd);
+	}
+	t->state = TRIGGER_REQUESTED;
+	t->id = ++trigger_id;
+	t->camera = camera;
+	t->fd = dup(fd);
+	t->requested_ms = now_ms();
+	t->triggered_ms = 0;
+	t->stem[0] = '\0';
+	t->files = 0;
+	return t;
+}
+
+static int camera_trigger_capture(struct tether_camera *tc) {
+	if(tc->sim != NULL) {
+		return simulated_camera_trigger_capture(tc->sim);
+	}
+	return gp_camera_trigger_capture(tc->camera, tc->context);
+}
+
+/* the trigger command, on the tether thread */
+static int trigger_fire(struct tether_camera *tc, void *arg) {
+	struct trigger *t = (struct trigger *) arg;
+	double start = now_ms();
+	int retval;
+
+	printf("%sTriggering a capture\n", tc->prefix);
+	retval = camera_trigger_capture(tc);
+	trace_end("trigger", NULL, start);
+	pthread_mutex_lock(&trigger_mutex);
+	if(retval == GP_OK && t->state == TRIGGER_REQUESTED) {
+		/* before the FILE_ADDED, which this thread handles next */
+		t->state = TRIGGER_FIRED;
+		t->triggered_ms = start;
+		trigger_reply(t, "{\"id\":%d,\"camera\":%d,\"triggered_ms\":%.1f}\n", t->id, t->camera, t->triggered_ms - t->requested_ms);
+	}
+	pthread_mutex_unlock(&trigger_mutex);
+	return retval;
+}
+
+/* trigger all cameras at once, and wait until each one has fired (or failed) */
+static int trigger_capture(int fd) {
+	int i, retval, num = cameras_count();
+	struct camera_command *cmds = malloc(num * sizeof(struct camera_command));
+	struct trigger **t = malloc(num * sizeof(struct trigger *));
+	int *ids = malloc(num * sizeof(int));
+
+	pthread_mutex_lock(&trigger_mutex);
+	for(i=0; i<num; i++) {
+		t[i] = trigger_new(fd, cameras[i]->index);
+		ids[i] = t[i]->id;
+	}
+	pthread_mutex_unlock(&trigger_mutex);
+	for(i=0; i<num; i++) {
+		cmds[i].func = &trigger_fire;
+		cmds[i].arg = t[i];
+		cmds[i].priority = CAMERA_PRIORITY_HIGH;
+		camera_command_submit(cameras[i], &cmds[i]);
+	}
+	for(i=0; i<num; i++) {
+		retval = camera_command_wait(cameras[i], &cmds[i]);
+		pthread_mutex_lock(&trigger_mutex);
+		if(t[i]->id == ids[i] && t[i]->state == TRIGGER_REQUESTED) {
+			trigger_reply(t[i], "{\"id\":%d,\"camera\":%d,\"error\":\"%s\"}\n", t[i]->id, t[i]->camera, gp_result_as_string(retval));
+			t[i]->state = TRIGGER_FREE;
+			if(t[i]->fd >= 0) {
+				close(t[i]->fd);
+				t[i]->fd = -1;
+			}
+		}
+		pthread_mutex_unlock(&trigger_mutex);
+	}
+	free(cmds);
+	free(t);
+	free(ids);
+	return num;
+}
+
+/* attribute a new file on the camera to the oldest trigger which has not got
+   one yet. without one, the file can only belong to the latest shot of the
+   camera, if it has the same name (the raw of a raw+jpg shot). names repeat
+   e.g. with capt0000.jpg when the capture target is the camera ram */
+static void trigger_file_added(struct tether_camera *tc, CameraFilePath *path, double added_ms) {
+	struct trigger *t, *fired = NULL, *latest = NULL, *shot = NULL;
+	char stem[sizeof(t->stem)];
+	char name[2 * sizeof(path->name)];
+	int i;
+
+	snprintf(stem, sizeof(stem), "%s", path->name);
+	stem[strcspn(stem, ".")] = '\0';
+	pthread_mutex_lock(&trigger_mutex);
+	for(i=0; i<TRIGGER_RING; i++) {
+		t = &triggers[i];
+		if(t->camera != tc->index) {
+			continue;
+		}
+		if(t->state == TRIGGER_FIRED && (fired == NULL || t->id < fired->id)) {
+			fired = t;
+		}
+		if(t->state == TRIGGER_SHOT && (latest == NULL || t->id > latest->id)) {
+			latest = t;
+		}
+	}
+	if(fired != NULL) {
+		shot = fired;
+	} else if(latest != NULL && latest->files < TRIGGER_FILES && strcmp(latest->stem, stem) == 0) {
+		shot = latest;
+	}
+	if(shot != NULL) {
+		if(shot->state == TRIGGER_FIRED) {
+			/* the earlier shots of the camera are complete now */
+			for(i=0; i<TRIGGER_RING; i++) {
+				t = &triggers[i];
+				if(t->camera == tc->index && t->state == TRIGGER_SHOT) {
+					t->state = TRIGGER_RETIRED;
+				}
+			}
+			shot->state = TRIGGER_SHOT;
+			strcpy(shot->stem, stem);
+			metrics_observe(STAGE_TRIGGER, added_ms - shot->triggered_ms);
+			tc->shutter_num++;
+			tc->shutter_sum += added_ms - shot->triggered_ms;
+		}
+		shot->added_ms[shot->files++] = added_ms;
+		trigger_reply(shot, "{\"id\":%d,\"camera\":%d,\"file\":\"%s\",\"shutter_ms\":%.1f}\n",
+			shot->id, shot->camera, json_escape(path->name, name, sizeof(name)), added_ms - shot->triggered_ms);
+	}
+	pthread_mutex_unlock(&trigger_mutex);
+}
+
+/* report a published file (jpg, raw, preview, display ...) of a triggered shot */
+static void trigger_published(struct published_file *pf) {
+	char path[2 * PATH_MAX];
+	struct trigger *t;
+	int i, j;
+
+	pthread_mutex_lock(&trigger_mutex);
+	for(i=0; i<TRIGGER_RING; i++) {
+		t = &triggers[i];
+		if(t->state != TRIGGER_SHOT && t->state != TRIGGER_RETIRED) {
+			continue;
+		}
+		for(j=0; j<t->files; j++) {
+			if(t->added_ms[j] == pf->added_ms) {
+				trigger_reply(t, "{\"id\":%d,\"camera\":%d,\"path\":\"%s\",\"type\":\"%s\",\"latency_ms\":%.1f}\n",
+					t->id, t->camera, json_escape(pf->path, path, sizeof(path)), pf->type, now_ms() - t->triggered_ms);
+			}
+		}
+	}
+	pthread_mutex_unlock(&trigger_mutex);
+}
+
+/* the time from the trigger until the camera announced the file, of the
+   shots since the last report. only the shots from the command socket have
+   a trigger time, not those from the shutter button. only call from the
+   tether thread */
+static void camera_event_latency_report(struct tether_camera *tc, const char *when) {
+	if(tc->shutter_num > 0) {
+		printf("%sEvent latency %s: %.1f ms mean over %d triggered shots\n", tc->prefix, when, tc->shutter_sum / tc->shutter_num, tc->shutter_num);
+	}
+	tc->shutter_num = 0;
+	tc->shutter_sum = 0;
+}
+
+static int parse_camera_setting(const char *arg, struct camera_setting *setting) {
+	const char *eq = strchr(arg, '=');
+
+	if(eq == NULL || eq == arg) {
+		return FALSE;
+	}
+	setting->name = strndup(arg, eq - arg);
+	setting->value = strdup(eq + 1);
+	return TRUE;
+}
+
+/* set a widget to the value, and keep the old value in old. returns 1 when
+   it changed, GP_OK when it had the value already */
+static int camera_widget_set(CameraWidget *widget, const char *value, char *old, size_t oldsize) {
+	CameraWidgetType type;
+	const char *text, *choice = NULL;
+	char *end;
+	float range;
+	int i, num, toggle, retval;
+
+	retval = gp_widget_get_type(widget, &type);
+	if(retval < GP_OK) {
+		return retval;
+	}
+	switch(type) {
+	case GP_WIDGET_TEXT:
+		gp_widget_get_value(widget, &text);
+		snprintf(old, oldsize, "%s", text);
+		if(strcmp(text, value) == 0) {
+			return GP_OK;
+		}
+		choice = value;
+		break;
+	case GP_WIDGET_RADIO:
+	case GP_WIDGET_MENU:
+		gp_widget_get_value(widget, &text);
+		snprintf(old, oldsize, "%s", text);
+		num = gp_widget_count_choices(widget);
+		for(i=0; i<num; i++) {
+			if(gp_widget_get_choice(widget, i, &choice) == GP_OK && strcasecmp(choice, value) == 0) {
+				break;
+			}
+		}
+		if(i == num) {
+			/* or the index of the choice, as with gphoto2 --set-config */
+			i = strtol(value, &end, 10);
+			if(end == value || *end != '\0' || i < 0 || i >= num || gp_widget_get_choice(widget, i, &choice) < GP_OK) {
+				return GP_ERROR_BAD_PARAMETERS;
+			}
+		}
+		if(strcmp(text, choice) == 0) {
+			return GP_OK;
+		}
+		break;
+	case GP_WIDGET_TOGGLE:
+		gp_widget_get_value(widget, &toggle);
+		snprintf(old, oldsize, "%d", toggle);
+		i = (strcasecmp(value, "on") == 0 || strcasecmp(value, "true") == 0) ? 1 : atoi(value);
+		if(i == toggle) {
+			return GP_OK;
+		}
+		return (retval = gp_widget_set_value(widget, &i)) < GP_OK ? retval : 1;
+	case GP_WIDGET_RANGE:
+		gp_widget_get_value(widget, &range);
+		snprintf(old, oldsize, "%g", range);
+		if(strtof(value, NULL) == range) {
+			return GP_OK;
+		}
+		range = strtof(value, NULL);
+		return (retval = gp_widget_set_value(widget, &range)) < GP_OK ? retval : 1;
+	default:
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	return (retval = gp_widget_set_value(widget, choice)) < GP_OK ? retval : 1;
+}
+
+/* set the widgets, with a single gp_camera_set_config for all of them.
+   returns the number of widgets which changed. only call from the tether
+   thread */
+static int camera_config_apply(struct tether_camera *tc, struct camera_setting *settings, int num) {
+	CameraWidget *root, *widget;
+	char old[128];
+	int i, retval, changed = 0;
+	double start = now_ms();
+
+	if(tc->sim != NULL) {
+		printf("%sCamera config is not supported by the simulated camera\n", tc->prefix);
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	retval = gp_camera_get_config(tc->camera, &root, tc->context);
+	if(retval < GP_OK) {
+		printf("%sCannot read the camera config: %s\n", tc->prefix, gp_result_as_string(retval));
+		return retval;
+	}
+	for(i=0; i<num; i++) {
+		if(gp_widget_get_child_by_name(root, settings[i].name, &widget) < GP_OK
+				&& gp_widget_get_child_by_label(root, settings[i].name, &widget) < GP_OK) {
+			printf("%sCamera config %s: not found\n", tc->prefix, settings[i].name);
+			continue;
+		}
+		retval = camera_widget_set(widget, settings[i].value, old, sizeof(old));
+		if(retval < GP_OK) {
+			printf("%sCamera config %s: cannot set to %s: %s\n", tc->prefix, settings[i].name, settings[i].value, gp_result_as_string(retval));
+		} else if(retval > 0) {
+			printf("%sCamera config %s: %s -> %s\n", tc->prefix, settings[i].name, old, settings[i].value);
+			changed++;
+		}
+	}
+	retval = GP_OK;
+	if(changed > 0) {
+		retval = gp_camera_set_config(tc->camera, root, tc->context);
+		if(retval < GP_OK) {
+			printf("%sCannot write the camera config: %s\n", tc->prefix, gp_result_as_string(retval));
+		}
+	}
+	gp_widget_free(root);
+	if(retval < GP_OK) {
+		return retval;
+	}
+	printf("%sCamera config: %d of %d settings changed, in %.0f ms\n", tc->prefix, changed, num, now_ms() - start);
+	return changed;
+}
+
+/* the config command, on the tether thread */
+static int camera_config_command(struct tether_camera *tc, void *arg) {
+	camera_event_latency_report(tc, "before the camera config");
+	return camera_config_apply(tc, (struct camera_setting *) arg, 1);
+}
+
+/* one thread per command client, reading one command per line */
+static void *command_client_threadfunc(void *arg) {
+	int fd = (int) (intptr_t) arg;
+	char line[256], reply[128];
+	FILE *f = fdopen(fd, "r");
+	int len;
+
+	while(f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if(strcmp(line, "capture") == 0) {
+			if(trigger_capture(fd) > 0) {
+				continue;
+			}
+			len = snprintf(reply, sizeof(reply), "{\"error\":\"no camera\"}\n");
+		} else if(strncmp(line, "config ", 7) == 0) {
+			struct camera_setting setting;
+			int i, num = cameras_count();
+
+			if(!parse_camera_setting(line + 7, &setting)) {
+				len = snprintf(reply, sizeof(reply), "{\"error\":\"usage: config NAME=VALUE\"}\n");
+			} else {
+				/* when the downloads are idle, one camera after the other */
+				for(i=0; i<num; i++) {
+					int retval = camera_call(cameras[i], CAMERA_PRIORITY_IDLE, &camera_config_command, &setting);
+					if(retval < GP_OK) {
+						len = snprintf(reply, sizeof(reply), "{\"camera\":%d,\"error\":\"%s\"}\n", cameras[i]->index, gp_result_as_string(retval));
+					} else {
+						len = snprintf(reply, sizeof(reply), "{\"camera\":%d,\"changed\":%d}\n", cameras[i]->index, retval);
+					}
+					send(fd, reply, len, MSG_NOSIGNAL);
+				}
+				free(setting.name);
+				free(setting.value);
+				if(num > 0) {
+					continue;
+				}
+				len = snprintf(reply, sizeof(reply), "{\"error\":\"no camera\"}\n");
+			}
+		} else if(line[0] == '\0') {
+			continue;
+		} else {
+			len = snprintf(reply, sizeof(reply), "{\"error\":\"unknown command\"}\n");
+		}
+		send(fd, reply, len, MSG_NOSIGNAL);
+	}
+	if(f != NULL) {
+		fclose(f);
+	} else {
+		close(fd);
+	}
+	return NULL;
+}
+
+static void *command_accept_threadfunc(void *arg) {
+	int listenfd = *(int *) arg;
+	pthread_t thread;
+	int fd;
+
+	while(TRUE) {
+		fd = accept(listenfd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Command socket accept error: %s\n", strerror(errno));
+			break;
+		}
+		pthread_create(&thread, NULL, &command_client_threadfunc, (void *) (intptr_t) fd);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int command_start(const char *path) {
+	static int listenfd;
+	pthread_t thread;
+	int i;
+
+	for(i=0; i<TRIGGER_RING; i++) {
+		triggers[i].fd = -1;
+	}
+	listenfd = unix_socket_listen(path);
+	if(listenfd < 0) {
+		return FALSE;
+	}
+	pthread_create(&thread, NULL, &command_accept_threadfunc, &listenfd);
+	pthread_detach(thread);
+	return TRUE;
+}
+
+static int camera_folder_list(struct tether_camera *tc, const char *folder, CameraList *files, CameraList *folders) {
+	int retval;
+
+	if(tc->sim != NULL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	retval = gp_camera_folder_list_files(tc->camera, folder, files, tc->context);
+	if(retval == GP_OK) {
+		retval = gp_camera_folder_list_folders(tc->camera, folder, folders, tc->context);
+	}
+	return retval;
+}
+
+static char *unique_filename(char *filename);
+
+/* the name of the copy of path in the mirror directory: unique for a new
+   file, so that nothing in the directory is overwritten, and the name of
+   the earlier copy when the file is published again */
+static char *mirror_dest(struct mirror *m, const char *path, int replace) {
+	const char *base = strrchr(path, '/');
+	struct mirror_name *mn;
+	char *dest, *unique;
+
+	for(mn = m->names.lh_first; mn != NULL; mn = mn->entries.le_next) {
+		if(strcmp(mn->path, path) == 0) {
+			if(replace) {
+				return strdup(mn->dest);
+			}
+			/* the same name again, e.g. after a delete on the camera */
+			LIST_REMOVE(mn, entries);
+			free(mn->path);
+			free(mn->dest);
+			free(mn);
+			break;
+		}
+	}
+	base = (base != NULL) ? base+1 : path;
+	dest = malloc(strlen(m->dir) + strlen(base) + 2);
+	sprintf(dest, "%s/%s", m->dir, base);
+	if(replace) {
+		return dest;
+	}
+	unique = unique_filename(dest);
+	if(strcmp(unique, dest) != 0) {
+		/* also when the copy fails, so that a republish does not overwrite dest */
+		mn = malloc(sizeof(struct mirror_name));
+		mn->path = strdup(path);
+		mn->dest = strdup(unique);
+		LIST_INSERT_HEAD(&m->names, mn, entries);
+	}
+	free(dest);
+	return unique;
+}
+
+/* copy a published file into the mirror directory, under a temporary name
+   first. the file has just been written, so it is read from the page cache */
+static int mirror_copy(struct mirror *m, const char *path, int replace) {
+	char *dest, *tmpFilename;
+	char buf[64 * 1024];
+	struct stat st;
+	off_t offset = 0;
+	ssize_t c;
+	int in, out, ok = TRUE;
+
+	dest = mirror_dest(m, path, replace);
+	tmpFilename = malloc(strlen(dest) + 6);
+	sprintf(tmpFilename, "%s.part", dest);
+	in = open(path, O_RDONLY);
+	out = open(tmpFilename, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	if(in < 0 || out < 0 || fstat(in, &st) != 0) {
+		fprintf(stderr, "Cannot mirror %s to %s\n", path, dest);
+		ok = FALSE;
+	}
+	while(ok && offset < st.st_size) {
+		c = sendfile(out, in, &offset, st.st_size - offset);
+		if(c < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* no in-kernel copy between these files */
+			c = pread(in, buf, sizeof(buf), offset);
+			if(c > 0 && write(out, buf, c) == c) {
+				offset += c;
+			} else {
+				c = -1;
+			}
+		}
+		if(c <= 0) {
+			fprintf(stderr, "Cannot mirror %s to %s: %s\n", path, dest, c < 0 ? strerror(errno) : "short file");
+			ok = FALSE;
+		}
+	}
+	if(ok) {
+		ok = (fdatasync(out) == 0);
+	}
+	if(out >= 0 && close(out) != 0) {
+		ok = FALSE;
+	}
+	if(in >= 0) {
+		close(in);
+	}
+	if(ok && rename(tmpFilename, dest) != 0) {
+		fprintf(stderr, "Cannot write file %s\n", dest);
+		ok = FALSE;
+	}
+	if(!ok && out >= 0) {
+		unlink(tmpFilename);
+	}
+	free(tmpFilename);
+	free(dest);
+	return ok;
+}
+
+static void *mirror_threadfunc(void *arg) {
+	struct mirror *m = (struct mirror *) arg;
+	struct mirror_job *job;
+	double start;
+	int ok;
+
+	trace_thread_name("mirror ", m->dir);
+	thread_role(ROLE_WORKER);
+	while(TRUE) {
+		pthread_mutex_lock(&m->mutex);
+		while(m->jobs.tqh_first == NULL) {
+			pthread_cond_wait(&m->cond, &m->mutex);
+		}
+		job = m->jobs.tqh_first;
+		pthread_mutex_unlock(&m->mutex);
+
+		start = trace_begin();
+		ok = mirror_copy(m, job->path, job->replace);
+		trace_end("mirror", job->path, start);
+
+		/* only dequeued when done, so that the lag includes the copy in progress */
+		pthread_mutex_lock(&m->mutex);
+		TAILQ_REMOVE(&m->jobs, job, entries);
+		m->depth--;
+		if(ok) {
+			m->files++;
+		} else {
+			m->errors++;
+		}
+		pthread_mutex_unlock(&m->mutex);
+		free(job->path);
+		free(job);
+	}
+	return NULL;
+}
+
+static void mirror_add(const char *dir) {
+	struct mirror *m;
+
+	m = malloc(sizeof(struct mirror));
+	mirrors = realloc(mirrors, (mirrors_num + 1) * sizeof(struct mirror *));
+	mirrors[mirrors_num++] = m;
+	m->dir = strdup(dir);
+	TAILQ_INIT(&m->jobs);
+	LIST_INIT(&m->names);
+	m->depth = 0;
+	m->files = 0;
+	m->errors = 0;
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_cond_init(&m->cond, NULL);
+}
+
+static void mirror_start(void) {
+	pthread_t thread;
+	int i;
+
+	for(i=0; i<mirrors_num; i++) {
+		pthread_create(&thread, NULL, &mirror_threadfunc, mirrors[i]);
+		pthread_detach(thread);
+	}
+}
+
+static void mirror_published(struct published_file *pf) {
+	struct mirror_job *job;
+	int i;
+
+	if(strcmp(pf->type, "jpg") != 0 && strcmp(pf->type, "raw") != 0 && strcmp(pf->type, "other") != 0) {
+		return;		/* previews and display copies are not in <receivepath> */
+	}
+	for(i=0; i<mirrors_num; i++) {
+		job = malloc(sizeof(struct mirror_job));
+		job->path = strdup(pf->path);
+		job->replace = !pf->download;
+		job->queued_ms = now_ms();
+		pthread_mutex_lock(&mirrors[i]->mutex);
+		TAILQ_INSERT_TAIL(&mirrors[i]->jobs, job, entries);
+		mirrors[i]->depth++;
+		pthread_cond_signal(&mirrors[i]->cond);
+		pthread_mutex_unlock(&mirrors[i]->mutex);
+	}
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void bench_report(void) {
+	struct bench_latencies *b;
+	int i;
+
+	pthread_mutex_lock(&bench_mutex);
+	printf("\nBenchmark: %d events, %.0f ms from the first event to the last published file\n",
+		simulated_camera_events(simulated_camera), bench_last_publish_ms - bench_first_event_ms);
+	printf("Event to publish latency:\n");
+	for(i=0; i<BENCH_TYPES; i++) {
+		b = &bench[i];
+		if(b->num == 0) {
+			continue;
+		}
+		qsort(b->ms, b->num, sizeof(double), compare_double);
+		printf("  %-8s n=%-4d min %7.1f  median %7.1f  p95 %7.1f  max %7.1f ms\n", b->type, b->num,
+			b->ms[0], b->ms[b->num / 2], b->ms[(b->num * 95 - 1) / 100], b->ms[b->num - 1]);
+	}
+	b = &bench_transfer;
+	if(b->num > 0) {
+		qsort(b->ms, b->num, sizeof(double), compare_double);
+		printf("USB transfer time per file:\n");
+		printf("  %-8s n=%-4d min %7.1f  median %7.1f  p95 %7.1f  max %7.1f ms\n", "", b->num,
+			b->ms[0], b->ms[b->num / 2], b->ms[(b->num * 95 - 1) / 100], b->ms[b->num - 1]);
+	}
+	pthread_mutex_unlock(&bench_mutex);
+	fflush(stdout);
+}
+
+static void bench_published(struct published_file *pf) {
+	int i, downloaded;
+
+	pthread_mutex_lock(&bench_mutex);
+	for(i=0; i<BENCH_TYPES; i++) {
+		/* the second publish of a jpg (deferred rotation, optimization) is not a download */
+		if(strcmp(bench[i].type, pf->type) == 0 && (pf->download || !bench[i].download)) {
+			bench[i].ms = realloc(bench[i].ms, (bench[i].num + 1) * sizeof(double));
+			bench[i].ms[bench[i].num++] = now_ms() - pf->added_ms;
+		}
+	}
+	if(pf->download) {
+		bench_downloads++;
+	}
+	downloaded = bench_downloads;
+	if(pf->download) {
+		bench_transfer.ms = realloc(bench_transfer.ms, (bench_transfer.num + 1) * sizeof(double));
+		bench_transfer.ms[bench_transfer.num++] = pf->transfer_ms;
+	}
+	if(bench_first_event_ms < 0 || pf->added_ms < bench_first_event_ms) {
+		bench_first_event_ms = pf->added_ms;
+	}
+	bench_last_publish_ms = now_ms();
+	pthread_mutex_unlock(&bench_mutex);
+
+	if(downloaded >= simulated_camera_events(simulated_camera)) {
+		/* the tether loop reports when the jpg threads are done with their display copies */
+		__atomic_store_n(&bench_downloads_done, TRUE, __ATOMIC_RELEASE);
+	}
+}
+
+static void file_published(struct published_file *pf) {
+	if(pf->sum != NULL) {
+		manifest_append(pf->path, pf->sum, !pf->download);
+	}
+	if(mirrors_num > 0) {
+		mirror_published(pf);
+	}
+	if(notify_socket != NULL) {
+		notify_published(pf);
+	}
+	if(command_socket != NULL) {
+		trigger_published(pf);
+	}
+	if(simulated_camera != NULL) {
+		bench_published(pf);
+	}
+}
+
+/* width/height from the SOF marker, if it is within the buffer */
+static int jpeg_buffer_dimensions(const unsigned char *buf, size_t len, int *width, int *height) {
+	size_t pos = 2;
+	int marker;
+
+	if(len < 4 || buf[0] != 0xff || buf[1] != 0xd8) {
+		return FALSE;
+	}
+	while(pos + 4 <= len) {
+		if(buf[pos] != 0xff) {
+			return FALSE;
+		}
+		marker = buf[pos+1];
+		if(marker == 0xff) {
+			pos++;
+			continue;
+		}
+		if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			if(pos + 9 > len) {
+				return FALSE;
+			}
+			*height = (buf[pos+5] << 8) | buf[pos+6];
+			*width = (buf[pos+7] << 8) | buf[pos+8];
+			return TRUE;
+		}
+		if(marker == 0xda) {
+			return FALSE;
+		}
+		pos += 2 + ((buf[pos+2] << 8) | buf[pos+3]);
+	}
+	return FALSE;
+}
+
+static int transform_swaps_dimensions(int transform) {
+	switch(transform) {
+		case JXFORM_ROT_90:
+		case JXFORM_ROT_270:
+		case JXFORM_TRANSPOSE:
+		case JXFORM_TRANSVERSE:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+static void metrics_print(FILE *f) {
+	struct metrics copy;
+	uint64_t cumulative;
+	int i, j, num, raw_queue_depth = 0, delete_queue_depth = 0, jpeg_busy;
+	uint64_t jpeg_full;
+
+	pthread_mutex_lock(&metrics.mutex);
+	memcpy(&copy, &metrics, sizeof(struct metrics));
+	pthread_mutex_unlock(&metrics.mutex);
+
+	fprintf(f, "# HELP continuouscapture_stage_duration_seconds Time spent per pipeline stage.\n");
+	fprintf(f, "# TYPE continuouscapture_stage_duration_seconds histogram\n");
+	for(i=0; i<STAGE_COUNT; i++) {
+		cumulative = 0;
+		for(j=0; j<METRICS_BUCKETS; j++) {
+			cumulative += copy.stages[i].buckets[j];
+			fprintf(f, "continuouscapture_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+				metrics_stage_names[i], metrics_buckets[j], (unsigned long long) cumulative);
+		}
+		fprintf(f, "continuouscapture_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+			metrics_stage_names[i], (unsigned long long) copy.stages[i].count);
+		fprintf(f, "continuouscapture_stage_duration_seconds_sum{stage=\"%s\"} %f\n", metrics_stage_names[i], copy.stages[i].sum);
+		fprintf(f, "continuouscapture_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+			metrics_stage_names[i], (unsigned long long) copy.stages[i].count);
+	}
+	fprintf(f, "# HELP continuouscapture_errors_total Errors per kind.\n");
+	fprintf(f, "# TYPE continuouscapture_errors_total counter\n");
+	for(i=0; i<ERROR_COUNT; i++) {
+		fprintf(f, "continuouscapture_errors_total{kind=\"%s\"} %llu\n", metrics_error_names[i], (unsigned long long) copy.errors[i]);
+	}
+	fprintf(f, "# HELP continuouscapture_downloaded_files_total Files downloaded from the camera.\n");
+	fprintf(f, "# TYPE continuouscapture_downloaded_files_total counter\n");
+	fprintf(f, "continuouscapture_downloaded_files_total %llu\n", (unsigned long long) copy.downloaded_files);
+	fprintf(f, "# HELP continuouscapture_downloaded_bytes_total Bytes downloaded from the camera.\n");
+	fprintf(f, "# TYPE continuouscapture_downloaded_bytes_total counter\n");
+	fprintf(f, "continuouscapture_downloaded_bytes_total %llu\n", (unsigned long long) copy.downloaded_bytes);
+
+	num = cameras_count();
+	for(i=0; i<num; i++) {
+		raw_queue_depth += cameras[i]->raw_queue_depth;
+		delete_queue_depth += cameras[i]->deletes.safe_count;
+	}
+	fprintf(f, "# HELP continuouscapture_raw_queue_depth Downloads waiting behind the jpgs.\n");
+	fprintf(f, "# TYPE continuouscapture_raw_queue_depth gauge\n");
+	fprintf(f, "continuouscapture_raw_queue_depth %d\n", raw_queue_depth);
+	fprintf(f, "# HELP continuouscapture_delete_queue_depth Downloaded files waiting for deletion on the camera.\n");
+	fprintf(f, "# TYPE continuouscapture_delete_queue_depth gauge\n");
+	fprintf(f, "continuouscapture_delete_queue_depth %d\n", delete_queue_depth);
+	fprintf(f, "# HELP continuouscapture_deferred_rotations Jpgs written unrotated under overload, waiting for their rotation.\n");
+	fprintf(f, "# TYPE continuouscapture_deferred_rotations gauge\n");
+	fprintf(f, "continuouscapture_deferred_rotations %d\n", __atomic_load_n(&deferred_rotations, __ATOMIC_RELAXED));
+	if(optimize_mode != 0) {
+		fprintf(f, "# HELP continuouscapture_optimize_queue_depth Published jpgs waiting for their idle-time optimization.\n");
+		fprintf(f, "# TYPE continuouscapture_optimize_queue_depth gauge\n");
+		fprintf(f, "continuouscapture_optimize_queue_depth %d\n", __atomic_load_n(&optimize_queue_depth, __ATOMIC_RELAXED));
+		fprintf(f, "# HELP continuouscapture_optimize_saved_bytes_total Bytes saved by the jpg optimization.\n");
+		fprintf(f, "# TYPE continuouscapture_optimize_saved_bytes_total counter\n");
+		fprintf(f, "continuouscapture_optimize_saved_bytes_total %llu\n", (unsigned long long) __atomic_load_n(&optimize_saved_bytes, __ATOMIC_RELAXED));
+	}
+	pthread_mutex_lock(&jpeg_pool.mutex);
+	jpeg_busy = jpeg_pool.num - jpeg_pool.free_num;
+	jpeg_full = jpeg_pool.full;
+	pthread_mutex_unlock(&jpeg_pool.mutex);
+	fprintf(f, "# HELP continuouscapture_jpeg_threads_busy Jpeg threads with a download or transform.\n");
+	fprintf(f, "# TYPE continuouscapture_jpeg_threads_busy gauge\n");
+	fprintf(f, "continuouscapture_jpeg_threads_busy %d\n", jpeg_busy);
+	fprintf(f, "# HELP continuouscapture_jpeg_threads_full_total Jpgs for which all jpeg threads were busy (blocked or spilled).\n");
+	fprintf(f, "# TYPE continuouscapture_jpeg_threads_full_total counter\n");
+	fprintf(f, "continuouscapture_jpeg_threads_full_total %llu\n", (unsigned long long) jpeg_full);
+	if(live_view != NULL) {
+		fprintf(f, "# HELP continuouscapture_live_view_frames_total Live view frames captured from the camera.\n");
+		fprintf(f, "# TYPE continuouscapture_live_view_frames_total counter\n");
+		fprintf(f, "continuouscapture_live_view_frames_total %llu\n", (unsigned long long) __atomic_load_n(&live_view->frames, __ATOMIC_RELAXED));
+		fprintf(f, "# HELP continuouscapture_live_view_dropped_frames_total Live view frames which were due but not captured, or not decoded in time.\n");
+		fprintf(f, "# TYPE continuouscapture_live_view_dropped_frames_total counter\n");
+		fprintf(f, "continuouscapture_live_view_dropped_frames_total %llu\n", (unsigned long long) __atomic_load_n(&live_view->dropped, __ATOMIC_RELAXED));
+	}
+	fprintf(f, "# HELP continuouscapture_duplicates_skipped_total Files on the camera which were downloaded before, and not downloaded again.\n");
+	fprintf(f, "# TYPE continuouscapture_duplicates_skipped_total counter\n");
+	fprintf(f, "continuouscapture_duplicates_skipped_total %llu\n", (unsigned long long) __atomic_load_n(&duplicates_skipped, __ATOMIC_RELAXED));
+
+	if(mirrors_num > 0) {
+		double now = now_ms();
+		fprintf(f, "# HELP continuouscapture_mirror_lag_seconds How long the oldest file waits for its copy, per mirror.\n");
+		fprintf(f, "# TYPE continuouscapture_mirror_lag_seconds gauge\n");
+		for(i=0; i<mirrors_num; i++) {
+			pthread_mutex_lock(&mirrors[i]->mutex);
+			fprintf(f, "continuouscapture_mirror_lag_seconds{dir=\"%s\"} %f\n", mirrors[i]->dir,
+				mirrors[i]->jobs.tqh_first != NULL ? (now - mirrors[i]->jobs.tqh_first->queued_ms) / 1000.0 : 0.0);
+			pthread_mutex_unlock(&mirrors[i]->mutex);
+		}
+		fprintf(f, "# HELP continuouscapture_mirror_queue_depth Files waiting for their copy, per mirror.\n");
+		fprintf(f, "# TYPE continuouscapture_mirror_queue_depth gauge\n");
+		for(i=0; i<mirrors_num; i++) {
+			fprintf(f, "continuouscapture_mirror_queue_depth{dir=\"%s\"} %d\n", mirrors[i]->dir, mirrors[i]->depth);
+		}
+		fprintf(f, "# HELP continuouscapture_mirror_files_total Files copied, per mirror.\n");
+		fprintf(f, "# TYPE continuouscapture_mirror_files_total counter\n");
+		for(i=0; i<mirrors_num; i++) {
+			fprintf(f, "continuouscapture_mirror_files_total{dir=\"%s\"} %llu\n", mirrors[i]->dir, (unsigned long long) mirrors[i]->files);
+		}
+		fprintf(f, "# HELP continuouscapture_mirror_errors_total Failed copies, per mirror.\n");
+		fprintf(f, "# TYPE continuouscapture_mirror_errors_total counter\n");
+		for(i=0; i<mirrors_num; i++) {
+			fprintf(f, "continuouscapture_mirror_errors_total{dir=\"%s\"} %llu\n", mirrors[i]->dir, (unsigned long long) mirrors[i]->errors);
+		}
+	}
+}
+
+/* every connection to the metrics socket gets one dump */
+static void *metrics_socket_threadfunc(void *arg) {
+	int listenfd = *(int *) arg;
+	FILE *f;
+	int fd;
+
+	while(TRUE) {
+		fd = accept(listenfd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Metrics socket accept error: %s\n", strerror(errno));
+			break;
+		}
+		f = fdopen(fd, "w");
+		if(f != NULL) {
+			metrics_print(f);
+			fclose(f);
+		} else {
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+/* dump to a file periodically, replacing it atomically (e.g. for node_exporter's textfile collector) */
+static void *metrics_file_threadfunc(void *arg) {
+	char *tmpFilename = malloc(strlen(metrics_file) + 6);
+	FILE *f;
+
+	sprintf(tmpFilename, "%s.part", metrics_file);
+	while(TRUE) {
+		f = fopen(tmpFilename, "w");
+		if(f != NULL) {
+			metrics_print(f);
+			if(fclose(f) == 0) {
+				rename(tmpFilename, metrics_file);
+			}
+		} else {
+			fprintf(stderr, "Cannot write metrics file %s\n", tmpFilename);
+		}
+		sleep(METRICS_FILE_INTERVAL);
+	}
+	return NULL;
+}
+
+static int unix_socket_listen(const char *path) {
+	struct sockaddr_un addr;
+	int listenfd;
+
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenfd < 0 || bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenfd, 8) < 0) {
+		fprintf(stderr, "Cannot create socket %s: %s\n", path, strerror(errno));
+		if(listenfd >= 0) {
+			close(listenfd);
+		}
+		return -1;
+	}
+	return listenfd;
+}
+
+static int metrics_start(void) {
+	static int listenfd;
+	pthread_t thread;
+
+	if(metrics_socket != NULL) {
+		listenfd = unix_socket_listen(metrics_socket);
+		if(listenfd < 0) {
+			return FALSE;
+		}
+		pthread_create(&thread, NULL, &metrics_socket_threadfunc, &listenfd);
+		pthread_detach(thread);
+	}
+	if(metrics_file != NULL) {
+		pthread_create(&thread, NULL, &metrics_file_threadfunc, NULL);
+		pthread_detach(thread);
+	}
+	return TRUE;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_submit(struct uring_writer *u, int b) {
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = u->fd;
+	sqe->off = u->offset[b];
+	sqe->user_data = b;
+	if(u->registered) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->addr = (unsigned long) u->iov[b].iov_base;
+		sqe->len = u->iov[b].iov_len;
+		sqe->buf_index = b;
+	} else {
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (unsigned long) &u->iov[b];
+		sqe->len = 1;
+	}
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if(syscall(__NR_io_uring_enter, u->ring_fd, 1, 0, 0, NULL, 0) < 0) {
+		fprintf(stderr, "io_uring submit error: %s\n", strerror(errno));
+		u->failed = TRUE;
+		return;
+	}
+	u->inflight++;
+}
+
+/* wait for (at least) one write to complete. short writes are submitted again */
+static void uring_reap(struct uring_writer *u) {
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int b;
+
+	head = *u->cq_head;
+	while(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		if(syscall(__NR_io_uring_enter, u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			fprintf(stderr, "io_uring wait error: %s\n", strerror(errno));
+			u->failed = TRUE;
+			u->inflight = 0;
+			return;
+		}
+	}
+	do {
+		cqe = &u->cqes[head & *u->cq_mask];
+		b = cqe->user_data;
+		u->inflight--;
+		if(cqe->res <= 0) {
+			fprintf(stderr, "Write error: %s\n", strerror(cqe->res < 0 ? -cqe->res : EIO));
+			u->failed = TRUE;
+			u->free_buf[u->free_num++] = b;
+		} else if(cqe->res < u->iov[b].iov_len) {
+			u->iov[b].iov_base = (unsigned char *) u->iov[b].iov_base + cqe->res;
+			u->iov[b].iov_len -= cqe->res;
+			u->offset[b] += cqe->res;
+			__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+			uring_submit(u, b);
+			continue;
+		} else {
+			u->free_buf[u->free_num++] = b;
+		}
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+	} while(head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE));
+}
+
+static void uring_writer_free(struct uring_writer *u) {
+	if(u->sqes != NULL && u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if(u->cq_ring != NULL && u->cq_ring != MAP_FAILED) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if(u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	if(u->ring_fd >= 0) {
+		close(u->ring_fd);
+	}
+	free(u->buffers);
+	free(u);
+}
+
+static struct uring_writer *uring_writer_new(void) {
+	struct uring_writer *u;
+	struct io_uring_params params;
+	struct iovec iov[URING_BUFFERS];
+	int i;
+
+	u = malloc(sizeof(struct uring_writer));
+	memset(u, 0, sizeof(struct uring_writer));
+	memset(&params, 0, sizeof(params));
+	u->ring_fd = syscall(__NR_io_uring_setup, URING_BUFFERS, &params);
+	if(u->ring_fd < 0) {
+		u->ring_fd = -1;
+		uring_writer_free(u);
+		return NULL;
+	}
+	u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	u->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	if(u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED || u->buffers == NULL) {
+		uring_writer_free(u);
+		return NULL;
+	}
+	u->sq_head = (unsigned *) ((char *) u->sq_ring + params.sq_off.head);
+	u->sq_tail = (unsigned *) ((char *) u->sq_ring + params.sq_off.tail);
+	u->sq_mask = (unsigned *) ((char *) u->sq_ring + params.sq_off.ring_mask);
+	u->sq_array = (unsigned *) ((char *) u->sq_ring + params.sq_off.array);
+	u->cq_head = (unsigned *) ((char *) u->cq_ring + params.cq_off.head);
+	u->cq_tail = (unsigned *) ((char *) u->cq_ring + params.cq_off.tail);
+	u->cq_mask = (unsigned *) ((char *) u->cq_ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + params.cq_off.cqes);
+
+	for(i=0; i<URING_BUFFERS; i++) {
+		iov[i].iov_base = u->buffers + i * URING_BUFFER_SIZE;
+		iov[i].iov_len = URING_BUFFER_SIZE;
+	}
+	/* registered buffers save the page pinning per write, but count against RLIMIT_MEMLOCK */
+	u->registered = (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0);
+	return u;
+}
+
+/* a ring for the download into fd, from an earlier download if there is one */
+static struct uring_writer *uring_writer_get(int fd) {
+	struct uring_writer *u;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	int i;
+
+	if(offset < 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&uring_free_mutex);
+	u = uring_free_writers;
+	if(u != NULL) {
+		uring_free_writers = u->next_free;
+	}
+	pthread_mutex_unlock(&uring_free_mutex);
+	if(u == NULL && (u = uring_writer_new()) == NULL) {
+		return NULL;
+	}
+	u->fd = fd;
+	u->next_offset = offset;
+	u->current = -1;
+	u->fill = 0;
+	u->inflight = 0;
+	u->failed = FALSE;
+	for(i=0; i<URING_BUFFERS; i++) {
+		u->free_buf[i] = URING_BUFFERS - 1 - i;
+	}
+	u->free_num = URING_BUFFERS;
+	return u;
+}
+
+/* hand the ring to the next download. not after an error, as writes of the
+   file could still be in it */
+static void uring_writer_put(struct uring_writer *u) {
+	if(u->failed) {
+		uring_writer_free(u);
+		return;
+	}
+	pthread_mutex_lock(&uring_free_mutex);
+	u->next_free = uring_free_writers;
+	uring_free_writers = u;
+	pthread_mutex_unlock(&uring_free_mutex);
+}
+
+/* submit the current buffer */
+static void uring_flush(struct uring_writer *u) {
+	int b = u->current;
+
+	if(b < 0 || u->fill == 0) {
+		return;
+	}
+	u->iov[b].iov_base = u->buffers + b * URING_BUFFER_SIZE;
+	u->iov[b].iov_len = u->fill;
+	u->offset[b] = u->next_offset;
+	u->next_offset += u->fill;
+	u->current = -1;
+	u->fill = 0;
+	uring_submit(u, b);
+}
+
+static void uring_write(struct uring_writer *u, const unsigned char *buf, size_t len) {
+	size_t c;
+
+	while(len > 0 && !u->failed) {
+		if(u->current < 0) {
+			while(u->free_num == 0 && !u->failed) {
+				uring_reap(u);	/* all buffers in flight: the only place where we wait for the disk */
+			}
+			if(u->failed) {
+				break;
+			}
+			u->current = u->free_buf[--u->free_num];
+			u->fill = 0;
+		}
+		c = URING_BUFFER_SIZE - u->fill;
+		if(c > len) {
+			c = len;
+		}
+		memcpy(u->buffers + u->current * URING_BUFFER_SIZE + u->fill, buf, c);
+		u->fill += c;
+		buf += c;
+		len -= c;
+		if(u->fill == URING_BUFFER_SIZE) {
+			uring_flush(u);
+		}
+	}
+}
+
+/* write what is left and wait for all writes, the file position is left at the end */
+static int uring_finish(struct uring_writer *u) {
+	if(!u->failed) {
+		uring_flush(u);
+	}
+	while(u->inflight > 0) {
+		uring_reap(u);
+	}
+	lseek(u->fd, u->next_offset, SEEK_SET);
+	return !u->failed;
+}
+#endif
+
+static void writer_init(struct download_writer *w, int fd, int hash) {
+	w->tee = NULL;
+	w->uring = NULL;
+	w->bytes = 0;
+	w->write_ms = 0;
+	w->fd = fd;
+	w->hash = hash;
+	w->failed = (fd < 0);
+	w->sum.crc = 0;
+	w->sum.size = 0;
+	w->head.crc = 0;
+	w->head.size = 0;
+	w->drop_cache = FALSE;
+	w->flushed = 0;
+	struct stat st;
+	/* not for the pipe to libjpeg */
+	w->write_behind = (write_behind_window > 0 && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+#ifdef HAVE_IO_URING
+	if(__atomic_load_n(&io_uring_writes, __ATOMIC_RELAXED) && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		w->uring = uring_writer_get(fd);
+		if(w->uring == NULL && __atomic_exchange_n(&io_uring_writes, FALSE, __ATOMIC_RELAXED)) {
+			/* e.g. an old kernel, or blocked by seccomp. the downloads in other threads may get here too */
+			fprintf(stderr, "io_uring not available (%s), using write()\n", strerror(errno));
+		}
+	}
+#endif
+}
+
+/* start the writeback of each completed window, and wait for the one before
+   it. so at most two windows of the file are dirty, and the wait is spread
+   over the download */
+static void writer_write_behind(struct download_writer *w) {
+	uint64_t prev;
+
+	while(w->bytes - w->flushed >= write_behind_window) {
+		sync_file_range(w->fd, w->flushed, write_behind_window, SYNC_FILE_RANGE_WRITE);
+		if(w->flushed >= write_behind_window) {
+			prev = w->flushed - write_behind_window;
+			sync_file_range(w->fd, prev, write_behind_window, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			if(w->drop_cache && prev > 0) {
+				/* clean now. the first window has the metadata (and often
+				   the preview), which is read again right after the download */
+				posix_fadvise(w->fd, prev, write_behind_window, POSIX_FADV_DONTNEED);
+			}
+		}
+		w->flushed += write_behind_window;
+	}
+}
+
+static void writer_write(struct download_writer *w, const unsigned char *buf, size_t len) {
+	ssize_t c;
+	double start;
+
+	if(w->tee != NULL) {
+		stream_buffer_append(w->tee, buf, len);
+	}
+	if(skip_duplicates && w->head.size < DEDUP_HEAD_SIZE) {
+		checksum_update(&w->head, buf, len < DEDUP_HEAD_SIZE - w->head.size ? len : DEDUP_HEAD_SIZE - w->head.size);
+	}
+	if(w->failed) {
+		return;
+	}
+	if(w->hash && checksum_manifest != NULL) {
+		checksum_update(&w->sum, buf, len);
+	}
+	w->bytes += len;
+	start = now_ms();
+#ifdef HAVE_IO_URING
+	if(w->uring != NULL) {
+		uring_write(w->uring, buf, len);
+		if(w->uring->failed) {
+			metrics_error(ERROR_WRITE);
+			w->failed = TRUE;
+		}
+		w->write_ms += now_ms() - start;
+		return;
+	}
+#endif
+	while(len > 0) {
+		c = write(w->fd, buf, len);
+		if(c <= 0) {
+			fprintf(stderr, "Write error: %s\n", strerror(errno));
+			metrics_error(ERROR_WRITE);
+			w->failed = TRUE;
+			break;
+		}
+		buf += c;
+		len -= c;
+	}
+	if(w->write_behind && !w->failed) {
+		writer_write_behind(w);
+	}
+	w->write_ms += now_ms() - start;
+}
+
+/* copy everything from the gphoto pipe to the writer, and close the pipe.
+   when this returns, all data is written to the file */
+static void writer_copy_from(struct download_writer *w, int fdfrom) {
+	unsigned char buf[128 * 1024];
+	int c;
+
+	while(TRUE) {
+		c = read(fdfrom, buf, sizeof(buf));
+		if(c <= 0) {
+			break;
+		}
+		writer_write(w, buf, c);
+	}
+	close(fdfrom);
+	if(w->write_behind && !w->failed && w->uring == NULL && w->bytes > w->flushed) {
+		/* the rest of the file, without waiting */
+		sync_file_range(w->fd, w->flushed, 0, SYNC_FILE_RANGE_WRITE);
+	}
+#ifdef HAVE_IO_URING
+	if(w->uring != NULL) {
+		double start = now_ms();
+		if(!uring_finish(w->uring) && !w->failed) {
+			metrics_error(ERROR_WRITE);
+			w->failed = TRUE;
+		}
+		w->write_ms += now_ms() - start;
+		uring_writer_put(w->uring);
+		w->uring = NULL;
+	}
+#endif
+}
+
+static void errordumper(GPLogLevel level, const char *domain, const char *str, void *data) {
+	fprintf(stderr, "ERROR: %s\n", str);
+}
+
+static int is_reserved_filename(const char *filename) {
+	struct reserved_name *r;
+	int found = FALSE;
+
+	pthread_mutex_lock(&reserved_mutex);
+	for(r = reserved_names.lh_first; r != NULL; r = r->entries.le_next) {
+		if(strcmp(r->filename, filename) == 0) {
+			found = TRUE;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reserved_mutex);
+	return found;
+}
+
+static void reserve_filename(const char *filename) {
+	struct reserved_name *r = malloc(sizeof(struct reserved_name));
+	r->filename = strdup(filename);
+	pthread_mutex_lock(&reserved_mutex);
+	LIST_INSERT_HEAD(&reserved_names, r, entries);
+	pthread_mutex_unlock(&reserved_mutex);
+}
+
+static void release_filename(const char *filename) {
+	struct reserved_name *r;
+
+	pthread_mutex_lock(&reserved_mutex);
+	for(r = reserved_names.lh_first; r != NULL; r = r->entries.le_next) {
+		if(strcmp(r->filename, filename) == 0) {
+			LIST_REMOVE(r, entries);
+			free(r->filename);
+			free(r);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reserved_mutex);
+}
+
+static char *unique_filename(char *filename) {
+	struct stat st;
+	char *result, *basename, *ext;
+	int num;
+
+	result = malloc(strlen(filename) + 10);
+	strcpy(result, filename);
+	basename = malloc(strlen(filename) +1);
+	strcpy(basename, filename);
+	ext = "";
+	for(num=strlen(basename)-1; num >= 0; num--) {
+		if(basename[num] == '.') {
+			ext = &basename[num+1];
+			basename[num] = '\0';
+			break;
+		}
+	}
+	num = 0;
+	while(stat(result, &st) == 0 || is_reserved_filename(result)) {
+		num++;
+		sprintf(result, "%s-%d.%s", basename, num, ext);
+	}
+	free(basename);
+	return result;
+}
+
+/* the camera operations of the tether loop, on the real or the simulated camera */
+static int camera_wait_for_event(struct tether_camera *tc, int timeout, CameraEventType *evttype, void **evtdata, double *event_ms) {
+	int retval;
+
+	if(tc->sim != NULL) {
+		*event_ms = now_ms();
+		return simulated_camera_wait_for_event(tc->sim, timeout, evttype, evtdata, event_ms);
+	}
+	retval = gp_camera_wait_for_event(tc->camera, timeout, evttype, evtdata, tc->context);
+	*event_ms = now_ms();
+	return retval;
+}
+
+static int camera_file_get(struct tether_camera *tc, const char *folder, const char *name, CameraFileType type, CameraFile *file) {
+	if(tc->sim != NULL) {
+		return simulated_camera_file_get(tc->sim, folder, name, type, file);
+	}
+	return gp_camera_file_get(tc->camera, folder, name, type, file, tc->context);
+}
+
+static int camera_file_delete(struct tether_camera *tc, const char *folder, const char *name) {
+	if(tc->sim != NULL) {
+		return simulated_camera_file_delete(tc->sim, folder, name);
+	}
+	return gp_camera_file_delete(tc->camera, folder, name, tc->context);
+}
+
+/* the simulated camera has no file info, so there are never duplicates */
+static int camera_file_get_info(struct tether_camera *tc, const char *folder, const char *name, CameraFileInfo *info) {
+	if(tc->sim != NULL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	return gp_camera_file_get_info(tc->camera, folder, name, info, tc->context);
+}
+
+static int camera_file_read(struct tether_camera *tc, const char *folder, const char *name, uint64_t offset, char *buf, uint64_t *size) {
+	if(tc->sim != NULL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	return gp_camera_file_read(tc->camera, folder, name, GP_FILE_TYPE_NORMAL, offset, buf, size, tc->context);
+}
+
+static int camera_capture_preview(struct tether_camera *tc, CameraFile *file) {
+	if(tc->sim != NULL) {
+		return simulated_camera_capture_preview(tc->sim, file);
+	}
+	return gp_camera_capture_preview(tc->camera, file, tc->context);
+}
+
+static void *work_pool_threadfunc(void *arg) {
+	struct work_pool *pool = (struct work_pool *) arg;
+	struct work_item *item;
+
+	trace_thread_name("worker", "");
+	thread_role(ROLE_WORKER);
+	while(TRUE) {
+		pthread_mutex_lock(&pool->mutex);
+		while(pool->head.tqh_first == NULL) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		item = pool->head.tqh_first;
+		TAILQ_REMOVE(&pool->head, item, entries);
+		pthread_mutex_unlock(&pool->mutex);
+
+		item->func(item->arg);
+		free(item);
+	}
+	return NULL;
+}
+
+static void work_pool_start(struct work_pool *pool, int num_threads) {
+	pthread_t thread;
+	int i;
+
+	TAILQ_INIT(&pool->head);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for(i=0; i<num_threads; i++) {
+		pthread_create(&thread, NULL, &work_pool_threadfunc, pool);
+		pthread_detach(thread);
+	}
+}
+
+static void work_pool_submit(struct work_pool *pool, void *(*func)(void *), void *arg) {
+	struct work_item *item = malloc(sizeof(struct work_item));
+	item->func = func;
+	item->arg = arg;
+	pthread_mutex_lock(&pool->mutex);
+	TAILQ_INSERT_TAIL(&pool->head, item, entries);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static struct journal_entry *journal_find(struct download_journal *j, CameraFilePath *path) {
+	struct journal_entry *je;
+
+	for(je = j->head.tqh_first; je != NULL; je = je->entries.tqe_next) {
+		if(strcmp(je->path.name, path->name) == 0 && strcmp(je->path.folder, path->folder) == 0) {
+			return je;
+		}
+	}
+	return NULL;
+}
+
+static struct journal_entry *journal_set(struct download_journal *j, CameraFilePath *path, char state) {
+	struct journal_entry *je = journal_find(j, path);
+
+	if(je == NULL) {
+		je = malloc(sizeof(struct journal_entry));
+		memcpy(&je->path, path, sizeof(CameraFilePath));
+		je->seen = FALSE;
+		je->queued = FALSE;
+		TAILQ_INSERT_TAIL(&j->head, je, entries);
+	}
+	je->state = state;
+	return je;
+}
+
+/* record a state change. only the tether loop of the camera writes its journal */
+static void journal_mark(struct download_journal *j, CameraFilePath *path, char state) {
+	struct journal_entry *je;
+
+	if(state == JOURNAL_DELETED) {
+		je = journal_find(j, path);
+		if(je != NULL) {
+			TAILQ_REMOVE(&j->head, je, entries);
+			free(je);
+		}
+	} else {
+		journal_set(j, path, state);
+	}
+	if(j->f == NULL) {
+		return;
+	}
+	fprintf(j->f, "%c\t%s\t%s\n", state, path->folder, path->name);
+	fflush(j->f);
+	if(state == JOURNAL_DONE) {
+		fdatasync(fileno(j->f));
+	}
+}
+
+static void delete_journal_append(struct delete_queue *dq, struct delete_entry *de) {
+	FILE *f = fopen(dq->journal, "a");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot write delete journal %s\n", dq->journal);
+		return;
+	}
+	fprintf(f, "%s\t%s\t%llu\t%s\n", de->path.folder, de->path.name, (unsigned long long) de->size, de->camera);
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+}
+
+static struct delete_entry *delete_queue_add(struct delete_queue *dq, CameraFilePath *path, int safe_on_disk) {
+	struct delete_entry *de = malloc(sizeof(struct delete_entry));
+	de->queue = dq;
+	memcpy(&de->path, path, sizeof(CameraFilePath));
+	de->safe_on_disk = safe_on_disk;
+	de->download_failed = FALSE;
+	de->size = 0;
+	snprintf(de->camera, sizeof(de->camera), "%s", dq->camera);
+	de->verify = FALSE;
+	de->retries = 0;
+	pthread_mutex_lock(&dq->mutex);
+	TAILQ_INSERT_TAIL(&dq->head, de, entries);
+	if(safe_on_disk) {
+		dq->safe_count++;
+	}
+	pthread_mutex_unlock(&dq->mutex);
+	return de;
+}
+
+/* called by the download side when the local copy of size bytes is complete (or failed) */
+static void delete_entry_done(struct delete_entry *de, int ok, uint64_t size) {
+	struct delete_queue *dq = de->queue;
+
+	pthread_mutex_lock(&dq->mutex);
+	if(ok && !de->download_failed) {
+		de->size = size;
+		delete_journal_append(dq, de);
+		de->safe_on_disk = TRUE;
+		dq->safe_count++;
+	} else {
+		printf("  Keeping %s on camera because the download failed\n", de->path.name);
+		TAILQ_REMOVE(&dq->head, de, entries);
+		free(de);
+	}
+	pthread_mutex_unlock(&dq->mutex);
+}
+
+static void delete_queue_load(struct delete_queue *dq) {
+	char line[sizeof(((CameraFilePath *)0)->folder) + sizeof(((CameraFilePath *)0)->name) + 200];
+	CameraFilePath path;
+	struct delete_entry *de;
+	unsigned long long size;
+	char *tab, *camera;
+	int n, old = 0;
+	FILE *f;
+
+	f = fopen(dq->journal, "r");
+	if(f == NULL) {
+		return;
+	}
+	while(fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		tab = strchr(line, '\t');
+		if(tab == NULL || tab - line >= sizeof(path.folder)) {
+			continue;
+		}
+		*tab = '\0';
+		camera = strchr(tab+1, '\t');
+		if(camera == NULL || camera - (tab+1) >= sizeof(path.name) ||
+				sscanf(camera+1, "%llu\t%n", &size, &n) != 1 || camera[1+n] == '\0') {
+			/* cut off, or of an older version without camera and size */
+			old++;
+			continue;
+		}
+		*camera = '\0';
+		strcpy(path.folder, line);
+		strcpy(path.name, tab+1);
+		de = delete_queue_add(dq, &path, TRUE);
+		de->size = size;
+		snprintf(de->camera, sizeof(de->camera), "%s", camera+1+n);
+		de->verify = TRUE;
+	}
+	fclose(f);
+	if(old > 0) {
+		printf("%d files in the delete journal do not tell their camera, they are kept on camera\n", old);
+	}
+	if(dq->safe_count > 0) {
+		printf("%d files from the delete journal are pending deletion on camera, once their camera is connected\n", dq->safe_count);
+	}
+}
+
+static void delete_queue_init(struct delete_queue *dq, const char *dir, const char *prefix, const char *camera) {
+	TAILQ_INIT(&dq->head);
+	pthread_mutex_init(&dq->mutex, NULL);
+	dq->journal = malloc(strlen(dir) + strlen(prefix) + 40);
+	sprintf(dq->journal, "%s/.continuousCameraCapture.%sdeletes", dir, prefix);
+	dq->camera = camera;
+	dq->safe_count = 0;
+	dq->burst_files = 0;
+	dq->burst_ms = 0;
+	delete_queue_load(dq);
+}
+
+/* after a reconnect, the card (or the camera on this port) may be another one */
+static void delete_queue_connected(struct delete_queue *dq) {
+	struct delete_entry *de;
+
+	pthread_mutex_lock(&dq->mutex);
+	for(de = dq->head.tqh_first; de != NULL; de = de->entries.tqe_next) {
+		de->verify = TRUE;
+	}
+	pthread_mutex_unlock(&dq->mutex);
+}
+
+static int delete_queue_pending(struct delete_queue *dq) {
+	return dq->head.tqh_first != NULL;
+}
+
+/* an entry from the journal or from an earlier connection is only deleted
+   from the camera it was downloaded from, and only when the file there still
+   has the size of the download (and is not e.g. a photo of the same name on
+   another card) */
+static int delete_entry_matches(struct tether_camera *tc, struct delete_entry *de) {
+	CameraFileInfo info;
+
+	if(strcmp(de->camera, tc->identity) != 0) {
+		printf("  Not deleting %s, it was downloaded from another camera (%s)\n", de->path.name, de->camera);
+		return FALSE;
+	}
+	if(!de->verify) {
+		return TRUE;
+	}
+	if(camera_file_get_info(tc, de->path.folder, de->path.name, &info) != GP_OK ||
+			!(info.file.fields & GP_FILE_INFO_SIZE) || info.file.size != de->size) {
+		printf("  Not deleting %s, the file on the camera is not the downloaded one\n", de->path.name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* delete (up to max) files on the camera which are safely on disk. only call from the tether loop */
+static void delete_queue_run(struct delete_queue *dq, struct tether_camera *tc, int max) {
+	struct delete_entry *de, *next;
+	double start;
+	int failed = FALSE;
+
+	pthread_mutex_lock(&dq->mutex);
+	for(de = dq->head.tqh_first; de != NULL && max > 0 && !failed; de = next) {
+		next = de->entries.tqe_next;
+		if(!de->safe_on_disk) {
+			continue;
+		}
+		TAILQ_REMOVE(&dq->head, de, entries);
+		dq->safe_count--;
+		pthread_mutex_unlock(&dq->mutex);
+
+		start = now_ms();
+		if(!delete_entry_matches(tc, de)) {
+			free(de);
+		} else {
+			printf("  Deleting %s on camera...\n", de->path.name);
+			if(camera_file_delete(tc, de->path.folder, de->path.name) != GP_OK) {
+				metrics_error(ERROR_DELETE);
+				failed = TRUE;
+			} else if(catch_up) {
+				journal_mark(&tc->journal, &de->path, JOURNAL_DELETED);
+			}
+			dq->burst_ms += now_ms() - start;
+			metrics_observe(STAGE_DELETE, now_ms() - start);
+			trace_end("deferred delete", de->path.name, start);
+			dq->burst_files++;
+			if(failed && ++de->retries < DELETE_RETRIES) {
+				/* e.g. the camera was busy. again in a later idle time, after the others */
+				de->verify = TRUE;
+				pthread_mutex_lock(&dq->mutex);
+				TAILQ_INSERT_TAIL(&dq->head, de, entries);
+				dq->safe_count++;
+				pthread_mutex_unlock(&dq->mutex);
+			} else {
+				if(failed) {
+					printf("  Cannot delete %s on camera, giving up after %d attempts\n", de->path.name, DELETE_RETRIES);
+				}
+				free(de);
+			}
+		}
+		max--;
+
+		pthread_mutex_lock(&dq->mutex);
+		next = dq->head.tqh_first;
+	}
+	if(dq->head.tqh_first == NULL) {
+		/* everything is deleted, so the journal can start over */
+		truncate(dq->journal, 0);
+		if(dq->burst_files > 0) {
+			printf("Deferred delete: %d files in %.0f ms kept off the download path\n", dq->burst_files, dq->burst_ms);
+		}
+		dq->burst_files = 0;
+		dq->burst_ms = 0;
+	}
+	pthread_mutex_unlock(&dq->mutex);
+}
+
+static void journal_open(struct download_journal *j) {
+	j->f = fopen(j->filename, "a");
+	if(j->f == NULL) {
+		fprintf(stderr, "Cannot write download journal %s\n", j->filename);
+	}
+}
+
+static void journal_init(struct download_journal *j, const char *dir, const char *prefix) {
+	char line[sizeof(((CameraFilePath *)0)->folder) + sizeof(((CameraFilePath *)0)->name) + 4];
+	CameraFilePath path;
+	char *tab;
+	FILE *f;
+
+	TAILQ_INIT(&j->head);
+	j->filename = malloc(strlen(dir) + strlen(prefix) + 40);
+	sprintf(j->filename, "%s/.continuousCameraCapture.%sjournal", dir, prefix);
+	j->existed = FALSE;
+	f = fopen(j->filename, "r");
+	if(f != NULL) {
+		j->existed = TRUE;
+		while(fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if(strchr("KPDX", line[0]) == NULL || line[1] != '\t' || (tab = strchr(line + 2, '\t')) == NULL ||
+					tab - (line + 2) >= sizeof(path.folder) || strlen(tab+1) >= sizeof(path.name)) {
+				continue;	/* e.g. the last line, cut off by a crash */
+			}
+			*tab = '\0';
+			strcpy(path.folder, line + 2);
+			strcpy(path.name, tab+1);
+			if(line[0] == JOURNAL_DELETED) {
+				struct journal_entry *je = journal_find(j, &path);
+				if(je != NULL) {
+					TAILQ_REMOVE(&j->head, je, entries);
+					free(je);
+				}
+			} else {
+				journal_set(j, &path, line[0]);
+			}
+		}
+		fclose(f);
+	}
+	journal_open(j);
+}
+
+/* rewrite the journal with only the files which are still on the camera */
+static void journal_compact(struct download_journal *j) {
+	struct journal_entry *je, *next;
+	char *tmpFilename;
+	FILE *f;
+
+	tmpFilename = malloc(strlen(j->filename) + 6);
+	sprintf(tmpFilename, "%s.part", j->filename);
+	f = fopen(tmpFilename, "w");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot write download journal %s\n", tmpFilename);
+		free(tmpFilename);
+		return;
+	}
+	for(je = j->head.tqh_first; je != NULL; je = next) {
+		next = je->entries.tqe_next;
+		if(!je->seen) {
+			TAILQ_REMOVE(&j->head, je, entries);
+			free(je);
+			continue;
+		}
+		fprintf(f, "%c\t%s\t%s\n", je->state, je->path.folder, je->path.name);
+		je->seen = FALSE;
+	}
+	fflush(f);
+	fdatasync(fileno(f));
+	if(j->f != NULL) {
+		fclose(j->f);
+	}
+	if(fclose(f) != 0 || rename(tmpFilename, j->filename) != 0) {
+		fprintf(stderr, "Cannot write download journal %s\n", j->filename);
+	}
+	free(tmpFilename);
+	j->existed = TRUE;
+	journal_open(j);
+}
+
+static unsigned dedup_hash(const char *name) {
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	const char *p;
+
+	for(p = name; *p; p++) {
+		h = (h ^ (unsigned char) *p) * 16777619u;
+	}
+	return h % DEDUP_BUCKETS;
+}
+
+/* the next entry with the name after de (NULL: the first one). a camera
+   which reuses its filenames has several. the caller holds dedup_mutex */
+static struct dedup_entry *dedup_find(const char *name, struct dedup_entry *de) {
+	for(de = (de == NULL) ? dedup_index[dedup_hash(name)] : de->next; de != NULL; de = de->next) {
+		if(strcmp(de->key.name, name) == 0) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/* FALSE when the index has the file already */
+static int dedup_insert(struct dedup_key *key, struct stream_checksum *head) {
+	struct dedup_entry *de;
+	unsigned bucket;
+
+	for(de = dedup_find(key->name, NULL); de != NULL; de = dedup_find(key->name, de)) {
+		if(de->key.size == key->size && de->head.size == head->size && de->head.crc == head->crc) {
+			return FALSE;
+		}
+	}
+	de = malloc(sizeof(struct dedup_entry));
+	de->key = *key;
+	de->head = *head;
+	bucket = dedup_hash(key->name);
+	de->next = dedup_index[bucket];
+	dedup_index[bucket] = de;
+	return TRUE;
+}
+
+/* load the index of the receive directory, and keep it open for appending */
+static void dedup_init(const char *dir) {
+	char line[sizeof(((struct dedup_key *)0)->name) + 80];
+	struct stream_checksum head;
+	struct dedup_key key;
+	unsigned long long size, headsize;
+	long long mtime;	/* of the camera file info, only in the lines of older versions */
+	char *filename;
+	int n, num = 0;
+	FILE *f;
+
+	filename = malloc(strlen(dir) + 40);
+	sprintf(filename, "%s/.continuousCameraCapture.index", dir);
+	f = fopen(filename, "r");
+	if(f != NULL) {
+		while(fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if(sscanf(line, "%x\t%llu\t%llu\t%lld\t%n", &head.crc, &headsize, &size, &mtime, &n) != 4 ||
+					line[n] == '\0' || strlen(line + n) >= sizeof(key.name)) {
+				continue;	/* e.g. the last line, cut off by a crash */
+			}
+			strcpy(key.name, line + n);
+			key.size = size;
+			head.size = headsize;
+			dedup_insert(&key, &head);
+			num++;
+		}
+		fclose(f);
+	}
+	dedup_file = fopen(filename, "a");
+	if(dedup_file == NULL) {
+		fprintf(stderr, "Cannot write duplicate index %s\n", filename);
+	}
+	printf("Duplicate index: %d files downloaded before\n", num);
+	free(filename);
+}
+
+/* remember a complete download. a lost line only costs a download again */
+static void dedup_record(struct dedup_key *key, struct stream_checksum *head, uint64_t size) {
+	if(!skip_duplicates || key->name[0] == '\0' || size == 0) {
+		return;
+	}
+	key->size = size;
+	pthread_mutex_lock(&dedup_mutex);
+	if(dedup_insert(key, head) && dedup_file != NULL) {
+		/* the 0 is where older versions had the date of the camera file */
+		fprintf(dedup_file, "%08x\t%llu\t%llu\t0\t%s\n", head->crc, (unsigned long long) head->size,
+			(unsigned long long) key->size, key->name);
+		fflush(dedup_file);
+	}
+	pthread_mutex_unlock(&dedup_mutex);
+}
+
+static void set_exif_int(ExifData *ed, ExifEntry *ee, long value) {
+	ExifByteOrder o = exif_data_get_byte_order(ed);
+
+	switch (ee->format) {
+		case EXIF_FORMAT_SHORT:
+			exif_set_short(ee->data, o, value);
+			break;
+		case EXIF_FORMAT_LONG:
+			exif_set_long(ee->data, o, value);
+			break;
+		case EXIF_FORMAT_SLONG:
+			exif_set_slong(ee->data, o, value);
+			break;
+		default:
+			fprintf(stderr,"ExifByteOrder unknown/unhandled format %d for int\n", ee->format);
+	}
+}
+
+static void update_exif_dimension(ExifData *ed, int transform, int src_x, int src_y) {
+	static struct {
+		int idf;
+		int tag;
+		int x;
+	} fields[] = {
+		{
+			.idf = EXIF_IFD_EXIF,
+			.tag = EXIF_TAG_PIXEL_X_DIMENSION,
+			.x   = 1,
+		},{
+			.idf = EXIF_IFD_EXIF,
+			.tag = EXIF_TAG_PIXEL_Y_DIMENSION,
+			.x   = 0,
+		},{
+			.idf = EXIF_IFD_INTEROPERABILITY,
+			.tag = EXIF_TAG_RELATED_IMAGE_WIDTH,
+			.x   = 1,
+		},{
+			.idf = EXIF_IFD_INTEROPERABILITY,
+			.tag = EXIF_TAG_RELATED_IMAGE_LENGTH,
+			.x   = 0,
+		}
+	};
+	ExifEntry *ee;
+	int i;
+
+	for (i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+		ee = exif_content_get_entry(ed->ifd[fields[i].idf], fields[i].tag);
+		if (ee != NULL) {
+			switch (transform) {
+				case JXFORM_ROT_90:
+				case JXFORM_ROT_270:
+				case JXFORM_TRANSPOSE:
+				case JXFORM_TRANSVERSE:
+					/* swap width/height */
+					set_exif_int(ed, ee, fields[i].x ? src_y : src_x);
+					break;
+				default:
+					/* original dimensions */
+					set_exif_int(ed, ee, fields[i].x ? src_x : src_y);
+					break;
+			}
+		}
+	}
+}
+
+static void jpegtran_do_transform(struct jpeg_decompress_struct *src, struct jpeg_compress_struct *dst, int transform);
+
+static void update_exif_thumbnail(ExifData *ed, int transform) {
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jpeg_error_mgr jsrcerr, jdsterr;
+	unsigned char *newthumb;
+	unsigned long newthumbsize;
+        newthumb = NULL;
+        newthumbsize = 0;
+
+	src.err = jpeg_std_error(&jsrcerr);
+	jpeg_create_decompress(&src);
+	jpeg_mem_src(&src, ed->data, ed->size);
+
+	dst.err = jpeg_std_error(&jdsterr);
+	jpeg_create_compress(&dst);
+	jpeg_mem_dest(&dst, &newthumb, &newthumbsize);
+
+	jpegtran_do_transform(&src, &dst, transform);
+
+	free(ed->data);
+	ed->data = newthumb;
+	ed->size = newthumbsize;
+}
+
+static void transform_exif(struct jpeg_decompress_struct *srcinfo, int transform) {
+	jpeg_saved_marker_ptr mark;
+	ExifData *ed = NULL;
+	ExifEntry *ee;
+	unsigned char *data;
+	unsigned int size;
+
+	for(mark = srcinfo->marker_list; NULL != mark; mark = mark->next) {
+		if (mark->marker == JPEG_APP0 +1) {
+			ed = exif_data_new_from_data(mark->data,mark->data_length);
+			break;
+		}
+	}
+	if(ed == NULL) {
+		return;
+	}
+
+	/* set orientation as standard */
+	ee = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_ORIENTATION);
+	if (ee != NULL) {
+		set_exif_int(ed, ee, 1);
+	}
+	ee = exif_content_get_entry(ed->ifd[EXIF_IFD_1], EXIF_TAG_ORIENTATION);
+	if (ee != NULL) {
+		set_exif_int(ed, ee, 1);
+	}
+	/* rotate the thumbnail */
+	if (ed->data && ed->data[0] == 0xff && ed->data[1] == 0xd8) {
+		update_exif_thumbnail(ed, transform);
+	}
+	/* and (guess what) modify dimension tags according to the rotation */
+	update_exif_dimension(ed, transform, srcinfo->image_width, srcinfo->image_height);
+
+	exif_data_save_data(ed, &data, &size);
+	exif_data_unref(ed);
+	/* update jpeg APP1 (EXIF) marker */
+	mark->data = srcinfo->mem->alloc_large((j_common_ptr)srcinfo, JPOOL_IMAGE, size);
+	mark->original_length = size;
+	mark->data_length = size;
+	memcpy(mark->data,data,size);
+	free(data);
+}
+
+static void jpegtran_do_transform(struct jpeg_decompress_struct *src, struct jpeg_compress_struct *dst, int transform) {
+	jvirt_barray_ptr * src_coef_arrays;
+	jvirt_barray_ptr * dst_coef_arrays;
+        jpeg_transform_info transformoption;
+
+	memset(&transformoption, 0, sizeof(transformoption));
+	transformoption.transform = transform;
+        transformoption.perfect = FALSE;
+        transformoption.trim = FALSE;
+        transformoption.force_grayscale = FALSE;
+        transformoption.crop = FALSE;
+
+	jcopy_markers_setup(src, JCOPYOPT_ALL);
+        jpeg_read_header(src, TRUE);
+
+	transform_exif(src, transform);
+
+	jtransform_request_workspace(src, &transformoption);
+	src_coef_arrays = jpeg_read_coefficients(src);
+	jpeg_copy_critical_parameters(src, dst);
+	dst_coef_arrays = jtransform_adjust_parameters(src, dst, src_coef_arrays, &transformoption);
+	jpeg_write_coefficients(dst, dst_coef_arrays);
+	jcopy_markers_execute(src, dst, JCOPYOPT_ALL);
+	jtransform_execute_transformation(src, dst, src_coef_arrays, &transformoption);
+
+	jpeg_finish_compress(dst);
+	jpeg_finish_decompress(src);
+
+	jpeg_destroy_compress(dst);
+        jpeg_destroy_decompress(src);
+}
+
+/* like jpeg_stdio_dest, but computing the checksum of what is written */
+struct checksum_destination_mgr {
+	struct jpeg_destination_mgr pub;
+	FILE *outfile;
+	JOCTET *buffer;
+	struct stream_checksum *sum;
+};
+#define CHECKSUM_DEST_BUF_SIZE (64 * 1024)
+
+static void checksum_dest_init(j_compress_ptr cinfo) {
+	struct checksum_destination_mgr *dest = (struct checksum_destination_mgr *) cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = CHECKSUM_DEST_BUF_SIZE;
+}
+
+static boolean checksum_dest_empty(j_compress_ptr cinfo) {
+	struct checksum_destination_mgr *dest = (struct checksum_destination_mgr *) cinfo->dest;
+	if(fwrite(dest->buffer, 1, CHECKSUM_DEST_BUF_SIZE, dest->outfile) != CHECKSUM_DEST_BUF_SIZE) {
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	}
+	checksum_update(dest->sum, dest->buffer, CHECKSUM_DEST_BUF_SIZE);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = CHECKSUM_DEST_BUF_SIZE;
+	return TRUE;
+}
+
+static void checksum_dest_term(j_compress_ptr cinfo) {
+	struct checksum_destination_mgr *dest = (struct checksum_destination_mgr *) cinfo->dest;
+	size_t datacount = CHECKSUM_DEST_BUF_SIZE - dest->pub.free_in_buffer;
+	if(datacount > 0) {
+		if(fwrite(dest->buffer, 1, datacount, dest->outfile) != datacount) {
+			ERREXIT(cinfo, JERR_FILE_WRITE);
+		}
+		checksum_update(dest->sum, dest->buffer, datacount);
+	}
+	fflush(dest->outfile);
+	if(ferror(dest->outfile)) {
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	}
+}
+
+static void jpeg_checksum_stdio_dest(j_compress_ptr cinfo, FILE *outfile, struct stream_checksum *sum) {
+	struct checksum_destination_mgr *dest;
+
+	dest = (struct checksum_destination_mgr *) (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(struct checksum_destination_mgr));
+	dest->buffer = (JOCTET *) (*cinfo->mem->alloc_large)((j_common_ptr) cinfo, JPOOL_PERMANENT, CHECKSUM_DEST_BUF_SIZE);
+	dest->pub.init_destination = checksum_dest_init;
+	dest->pub.empty_output_buffer = checksum_dest_empty;
+	dest->pub.term_destination = checksum_dest_term;
+	dest->outfile = outfile;
+	dest->sum = sum;
+	cinfo->dest = (struct jpeg_destination_mgr *) dest;
+}
+
+void *jpegtransform_threadfunc(void *arg) {
+	struct jpeg_info *jpeg_trans_arg = (struct jpeg_info *) arg;
+        struct jpeg_decompress_struct src;
+        struct jpeg_compress_struct dst;
+        struct jpeg_error_mgr jsrcerr, jdsterr;
+	double start = now_ms();
+
+	trace_thread_name("jpeg transform", "");
+	thread_role(ROLE_TRANSFORM);
+	src.err = jpeg_std_error(&jsrcerr);
+	jpeg_create_decompress(&src);
+	jpeg_stdio_src(&src, jpeg_trans_arg->src);
+
+	dst.err = jpeg_std_error(&jdsterr);
+	jpeg_create_compress(&dst);
+	if(checksum_manifest != NULL) {
+		jpeg_checksum_stdio_dest(&dst, jpeg_trans_arg->dest, &jpeg_trans_arg->sum);
+	} else {
+		jpeg_stdio_dest(&dst, jpeg_trans_arg->dest);
+	}
+
+	jpegtran_do_transform(&src, &dst, jpeg_trans_arg->transform);
+
+	fclose(jpeg_trans_arg->src);
+	if(jpeg_trans_arg->delete_entry != NULL) {
+		fflush(jpeg_trans_arg->dest);
+		fsync(fileno(jpeg_trans_arg->dest));
+	}
+	fclose(jpeg_trans_arg->dest);
+	metrics_observe(STAGE_TRANSFORM, now_ms() - start);
+	trace_end("transform", NULL, start);
+
+        return NULL;
+}
+
+/* jpgs being downloaded (or transformed) plus the files queued in the tether loops */
+static int pipeline_backlog(void) {
+	int i, num = cameras_count(), backlog = __atomic_load_n(&jpeg_inflight, __ATOMIC_RELAXED);
+
+	for(i=0; i<num; i++) {
+		backlog += cameras[i]->raw_queue_depth;
+	}
+	return backlog;
+}
+
+static void optimize_defer(const char *filename, int transform, double added_ms) {
+	struct optimize_job *job;
+
+	if(optimize_mode == 0) {
+		return;
+	}
+	job = malloc(sizeof(struct optimize_job));
+	job->filename = strdup(filename);
+	job->transform = transform;
+	job->added_ms = added_ms;
+	__atomic_add_fetch(&optimize_queue_depth, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&optimize_mutex);
+	TAILQ_INSERT_TAIL(&optimize_queue, job, entries);
+	pthread_cond_signal(&optimize_cond);
+	pthread_mutex_unlock(&optimize_mutex);
+}
+
+static void rotation_defer(const char *filename, int transform, double added_ms) {
+	struct rotation_job *job = malloc(sizeof(struct rotation_job));
+
+	job->filename = strdup(filename);
+	job->transform = transform;
+	job->added_ms = added_ms;
+	__atomic_add_fetch(&deferred_rotations, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&rotation_mutex);
+	TAILQ_INSERT_TAIL(&rotation_queue, job, entries);
+	pthread_cond_signal(&rotation_cond);
+	pthread_mutex_unlock(&rotation_mutex);
+}
+
+/* rotate a jpg which was written unrotated, and replace it atomically */
+static void rotation_run(struct rotation_job *job) {
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jpeg_error_mgr jsrcerr, jdsterr;
+	struct stream_checksum sum = { 0, 0 };
+	struct published_file pf = { job->filename, "jpg", 0, 0, job->transform, job->added_ms, 0,
+		checksum_manifest == NULL ? NULL : &sum };
+	char *tmpFilename;
+	FILE *in, *out;
+	int ok;
+	double start = now_ms();
+
+	in = fopen(job->filename, "rb");
+	if(in == NULL) {
+		fprintf(stderr, "Cannot read file %s for its deferred rotation\n", job->filename);
+		return;
+	}
+	tmpFilename = malloc(strlen(job->filename) + 6);
+	sprintf(tmpFilename, "%s.part", job->filename);
+	out = fopen(tmpFilename, "wb");
+	if(out == NULL) {
+		fprintf(stderr, "Cannot create file %s\n", tmpFilename);
+		fclose(in);
+		free(tmpFilename);
+		return;
+	}
+	src.err = jpeg_std_error(&jsrcerr);
+	jpeg_create_decompress(&src);
+	jpeg_stdio_src(&src, in);
+	dst.err = jpeg_std_error(&jdsterr);
+	jpeg_create_compress(&dst);
+	if(checksum_manifest != NULL) {
+		jpeg_checksum_stdio_dest(&dst, out, &sum);
+	} else {
+		jpeg_stdio_dest(&dst, out);
+	}
+	jpegtran_do_transform(&src, &dst, job->transform);
+	fclose(in);
+	fflush(out);
+	fdatasync(fileno(out));
+	ok = (fclose(out) == 0) && (rename(tmpFilename, job->filename) == 0);
+	if(ok) {
+		printf("  Deferred rotation of %s done\n", job->filename);
+		metrics_observe(STAGE_TRANSFORM, now_ms() - start);
+		trace_end("deferred rotation", job->filename, start);
+		file_published(&pf);
+		optimize_defer(job->filename, job->transform, job->added_ms);
+	} else {
+		fprintf(stderr, "Cannot write file %s\n", job->filename);
+		unlink(tmpFilename);
+	}
+	free(tmpFilename);
+}
+
+static void *rotation_threadfunc(void *arg) {
+	struct rotation_job *job;
+
+	trace_thread_name("deferred rotation", "");
+	thread_role(ROLE_TRANSFORM);
+	while(TRUE) {
+		pthread_mutex_lock(&rotation_mutex);
+		while(rotation_queue.tqh_first == NULL) {
+			pthread_cond_wait(&rotation_cond, &rotation_mutex);
+		}
+		pthread_mutex_unlock(&rotation_mutex);
+
+		/* only when the downloads are idle */
+		while(pipeline_backlog() > 0) {
+			usleep(DEGRADE_IDLE_POLL_MS * 1000);
+		}
+		pthread_mutex_lock(&rotation_mutex);
+		job = rotation_queue.tqh_first;
+		TAILQ_REMOVE(&rotation_queue, job, entries);
+		pthread_mutex_unlock(&rotation_mutex);
+
+		rotation_run(job);
+		__atomic_sub_fetch(&deferred_rotations, 1, __ATOMIC_RELAXED);
+		free(job->filename);
+		free(job);
+	}
+	return NULL;
+}
+
+char *get_exif_date(ExifData *ed) {
+	if(ed) {
+		ExifEntry *entry = exif_data_get_entry(ed, EXIF_TAG_DATE_TIME_ORIGINAL);
+		if(entry) {
+			char *ret = malloc(entry->size+1);
+			ret[entry->size] = '\0'; // just in case, to make sure that it's really \0-terminated (robustness)
+			memcpy(ret, entry->data, entry->size);
+			return ret;
+		}
+	}
+	return NULL;
+}
+
+static int orientation_transform(int orientation) {
+	switch (orientation) {
+		case 8: { return JXFORM_ROT_270; }
+		case 7: { return JXFORM_TRANSVERSE; }
+		case 6: { return JXFORM_ROT_90; }
+		case 5: { return JXFORM_TRANSPOSE; }
+		case 4: { return JXFORM_FLIP_V; }
+		case 3: { return JXFORM_ROT_180; }
+		case 2: { return JXFORM_FLIP_H; }
+		case 1:
+		default: { return JXFORM_NONE; }
+	}
+}
+
+int get_exif_orientation_transform(ExifData *ed) {
+	if(ed) {
+		ExifByteOrder byte_order = exif_data_get_byte_order(ed);
+		ExifEntry *entry = exif_data_get_entry(ed, EXIF_TAG_ORIENTATION);
+		if(entry) {
+			return orientation_transform(exif_get_short(entry->data, byte_order));
+		}
+	}
+	return JXFORM_NONE;
+}
 
-struct jpeg_info {
-	char *camerafilename;
-	int fd_from_gphoto;
-	FILE *src;
-	FILE *dest;
-	int transform;
+/* the tags which the download needs from a jpg, read in place from the exif
+   APP1 segment: no allocations, and no maker notes, unlike a libexif tree */
+struct exif_sniff {
+	int orientation;	/* 0 when there is none */
+	char date[20];		/* DateTimeOriginal, empty when there is none */
 };
 
-static void errordumper(GPLogLevel level, const char *domain, const char *str, void *data) {
-	fprintf(stderr, "ERROR: %s\n", str);
+#define TIFF_TYPE_ASCII 2
+#define TIFF_TYPE_SHORT 3
+
+static unsigned exif_sniff_get16(const unsigned char *p, int motorola) {
+	return motorola ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
 }
 
-static char *unique_filename(char *filename) {
-	struct stat st;
-	char *result, *basename, *ext;
-	int num;
+static unsigned exif_sniff_get32(const unsigned char *p, int motorola) {
+	return motorola ? ((unsigned) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])
+	                : ((unsigned) p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
 
-	result = malloc(strlen(filename) + 10);
-	strcpy(result, filename);
-	basename = malloc(strlen(filename) +1);
-	strcpy(basename, filename);
-	ext = "";
-	for(num=strlen(basename)-1; num >= 0; num--) {
-		if(basename[num] == '.') {
-			ext = &basename[num+1];
-			basename[num] = '\0';
-			break;
-		}
+/* the entries of the IFD at offset (from the TIFF header). tags which have
+   been found in an earlier IFD are kept, so the IFDs are scanned in the
+   order of exif_data_get_entry: IFD0, Exif (GPS and Interop do not have
+   these tags), IFD1.
+   returns the offset of the next IFD (0 when none), or -1 when the IFD is
+   out of bounds */
+static long exif_sniff_ifd(const unsigned char *tiff, size_t len, size_t offset, int motorola, struct exif_sniff *sniff, size_t *exif_ifd) {
+	const unsigned char *e;
+	size_t value, n;
+	unsigned i, num, tag, type, count;
+
+	if(offset < 8 || offset + 2 > len) {
+		return -1;
 	}
-	num = 0;
-	while(stat(result, &st) == 0) {
-		num++;
-		sprintf(result, "%s-%d.%s", basename, num, ext);
+	num = exif_sniff_get16(tiff + offset, motorola);
+	if(offset + 2 + 12 * (size_t) num + 4 > len) {
+		return -1;
 	}
-	free(basename);
-	return result;
+	for(i=0; i<num; i++) {
+		e = tiff + offset + 2 + 12 * i;
+		tag = exif_sniff_get16(e, motorola);
+		type = exif_sniff_get16(e + 2, motorola);
+		count = exif_sniff_get32(e + 4, motorola);
+		if(tag == EXIF_TAG_ORIENTATION && type == TIFF_TYPE_SHORT && count >= 1 && sniff->orientation == 0) {
+			sniff->orientation = exif_sniff_get16(e + 8, motorola);
+		} else if(tag == EXIF_TAG_EXIF_IFD_POINTER && exif_ifd != NULL) {
+			*exif_ifd = exif_sniff_get32(e + 8, motorola);
+		} else if(tag == EXIF_TAG_DATE_TIME_ORIGINAL && type == TIFF_TYPE_ASCII && count >= 1 && sniff->date[0] == '\0') {
+			/* up to 4 bytes are in the entry itself */
+			value = (count > 4) ? exif_sniff_get32(e + 8, motorola) : (size_t) (e + 8 - tiff);
+			if(value >= len || count > len - value) {
+				return -1;
+			}
+			n = (count < sizeof(sniff->date)) ? count : sizeof(sniff->date) - 1;
+			memcpy(sniff->date, tiff + value, n);
+			sniff->date[n] = '\0';
+		}
+	}
+	return exif_sniff_get32(tiff + offset + 2 + 12 * num, motorola);
 }
 
-static void set_exif_int(ExifData *ed, ExifEntry *ee, long value) {
-	ExifByteOrder o = exif_data_get_byte_order(ed);
+/* scan the markers of the jpg in buf for the exif APP1 segment, and read
+   orientation and date from IFD0, the Exif IFD and IFD1. returns FALSE when
+   the data is malformed (or the APP1 does not fit into buf), so that libexif
+   gets to try */
+static int exif_sniff_scan(const unsigned char *buf, size_t len, struct exif_sniff *sniff) {
+	const unsigned char *tiff;
+	size_t pos = 2, seglen, tifflen, exif_ifd = 0;
+	long next;
+	int motorola;
 
-	switch (ee->format) {
-		case EXIF_FORMAT_SHORT:
-			exif_set_short(ee->data, o, value);
-			break;
-		case EXIF_FORMAT_LONG:
-			exif_set_long(ee->data, o, value);
-			break;
-		case EXIF_FORMAT_SLONG:
-			exif_set_slong(ee->data, o, value);
-			break;
-		default:
-			fprintf(stderr,"ExifByteOrder unknown/unhandled format %d for int\n", ee->format);
+	sniff->orientation = 0;
+	sniff->date[0] = '\0';
+	if(len < 4 || buf[0] != 0xff || buf[1] != 0xd8) {
+		return FALSE;
+	}
+	while(pos + 4 <= len) {
+		if(buf[pos] != 0xff) {
+			return FALSE;
+		}
+		if(buf[pos + 1] == 0xff) {
+			/* fill byte */
+			pos++;
+			continue;
+		}
+		if(buf[pos + 1] == 0xda || buf[pos + 1] == 0xd9) {
+			/* the image data, and no exif before it */
+			return TRUE;
+		}
+		seglen = buf[pos + 2] << 8 | buf[pos + 3];
+		if(seglen < 2 || pos + 2 + seglen > len) {
+			return FALSE;
+		}
+		if(buf[pos + 1] == 0xe1 && seglen >= 2 + 6 + 8 && memcmp(buf + pos + 4, "Exif\0\0", 6) == 0) {
+			tiff = buf + pos + 10;
+			tifflen = seglen - 8;
+			if(memcmp(tiff, "MM\0*", 4) == 0) {
+				motorola = TRUE;
+			} else if(memcmp(tiff, "II*\0", 4) == 0) {
+				motorola = FALSE;
+			} else {
+				return FALSE;
+			}
+			next = exif_sniff_ifd(tiff, tifflen, exif_sniff_get32(tiff + 4, motorola), motorola, sniff, &exif_ifd);
+			if(next < 0) {
+				return FALSE;
+			}
+			if(exif_ifd > 0 && exif_sniff_ifd(tiff, tifflen, exif_ifd, motorola, sniff, NULL) < 0) {
+				return FALSE;
+			}
+			if(next > 0 && exif_sniff_ifd(tiff, tifflen, next, motorola, sniff, NULL) < 0) {
+				return FALSE;
+			}
+			return TRUE;
+		}
+		pos += 2 + seglen;
 	}
+	return FALSE;
 }
 
-static void update_exif_dimension(ExifData *ed, int transform, int src_x, int src_y) {
-	static struct {
-		int idf;
-		int tag;
-		int x;
-	} fields[] = {
-		{
-			.idf = EXIF_IFD_EXIF,
-			.tag = EXIF_TAG_PIXEL_X_DIMENSION,
-			.x   = 1,
-		},{
-			.idf = EXIF_IFD_EXIF,
-			.tag = EXIF_TAG_PIXEL_Y_DIMENSION,
-			.x   = 0,
-		},{
-			.idf = EXIF_IFD_INTEROPERABILITY,
-			.tag = EXIF_TAG_RELATED_IMAGE_WIDTH,
-			.x   = 1,
-		},{
-			.idf = EXIF_IFD_INTEROPERABILITY,
-			.tag = EXIF_TAG_RELATED_IMAGE_LENGTH,
-			.x   = 0,
+/* the exif date based filename in receivedir (not yet unique). takes over
+   the date, which can be NULL */
+static char *get_jpeg_filename_from_date(char *filename, const char *camerafilename, const char *prefix) {
+	if(filename != NULL) {
+		int i;
+		for(i=strlen(filename)-1; i>= 0; i--) {
+			if (filename[i] < '0' || filename[i] > '9') {
+				filename[i] = '_';
+			}
 		}
-	};
-	ExifEntry *ee;
-	int i;
+		filename = realloc(filename, strlen(filename) +5);
+		strcat(filename, ".jpg");
+	} else {
+		filename = strdup(camerafilename);
+	}
+	char *full_filename = malloc(strlen(receivedir) + strlen(prefix) + strlen(filename) + 2);
+	sprintf(full_filename, "%s/%s%s", receivedir, prefix, filename);
+	free(filename);
+	return full_filename;
+}
 
-	for (i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
-		ee = exif_content_get_entry(ed->ifd[fields[i].idf], fields[i].tag);
-		if (ee != NULL) {
-			switch (transform) {
-				case JXFORM_ROT_90:
-				case JXFORM_ROT_270:
-				case JXFORM_TRANSPOSE:
-				case JXFORM_TRANSVERSE:
-					/* swap width/height */
-					set_exif_int(ed, ee, fields[i].x ? src_y : src_x);
-					break;
-				default:
-					/* original dimensions */
-					set_exif_int(ed, ee, fields[i].x ? src_x : src_y);
-					break;
-			}
+char *get_jpeg_filename(ExifData *ed, const char *camerafilename, const char *prefix) {
+	return get_jpeg_filename_from_date(get_exif_date(ed), camerafilename, prefix);
+}
+
+/* orientation transform and date of the jpg at the start of buf, with the
+   scanner, or with libexif when the scanner cannot make sense of it */
+static int exif_sniff_jpeg(const unsigned char *buf, size_t len, char **date) {
+	struct exif_sniff sniff;
+	ExifData *ed;
+	int transform;
+
+	if(exif_sniff_scan(buf, len, &sniff)) {
+		*date = (sniff.date[0] != '\0') ? strdup(sniff.date) : NULL;
+		return orientation_transform(sniff.orientation);
+	}
+	ed = exif_data_new_from_data(buf, len);
+	transform = get_exif_orientation_transform(ed);
+	*date = get_exif_date(ed);
+	if(ed) {
+		exif_data_unref(ed);
+	}
+	return transform;
+}
+
+/* --bench-sniff: the time per file of the exif sniff of the downloads, with
+   the scanner and with a libexif tree, on the first 128 KB of a jpg */
+static int bench_sniff(const char *filename) {
+	static unsigned char buf[128 * 1024];
+	struct exif_sniff sniff;
+	FILE *f = fopen(filename, "rb");
+	size_t len;
+	ExifData *ed;
+	char *date;
+	double start, scan_us, libexif_us;
+	int i, n = 10000, transform;
+
+	if(f == NULL) {
+		fprintf(stderr, "Cannot open %s\n", filename);
+		return FALSE;
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+
+	if(!exif_sniff_scan(buf, len, &sniff)) {
+		printf("%s: the scanner falls back to libexif\n", filename);
+	}
+	ed = exif_data_new_from_data(buf, len);
+	transform = get_exif_orientation_transform(ed);
+	date = get_exif_date(ed);
+	if(ed) {
+		exif_data_unref(ed);
+	}
+	printf("scanner: orientation %d, date %s\n", sniff.orientation, sniff.date[0] != '\0' ? sniff.date : "none");
+	printf("libexif: transform %d, date %s\n", transform, date != NULL ? date : "none");
+	if(orientation_transform(sniff.orientation) != transform || strcmp(sniff.date, date != NULL ? date : "") != 0) {
+		printf("The scanner and libexif disagree\n");
+	}
+	free(date);
+
+	start = now_ms();
+	for(i=0; i<n; i++) {
+		exif_sniff_scan(buf, len, &sniff);
+	}
+	scan_us = (now_ms() - start) * 1000 / n;
+	start = now_ms();
+	for(i=0; i<n / 10; i++) {
+		ed = exif_data_new_from_data(buf, len);
+		get_exif_orientation_transform(ed);
+		free(get_exif_date(ed));
+		if(ed) {
+			exif_data_unref(ed);
 		}
 	}
+	libexif_us = (now_ms() - start) * 1000 / (n / 10);
+	printf("Exif sniff per file: scanner %.2f us, libexif %.2f us\n", scan_us, libexif_us);
+	return TRUE;
 }
 
-static void jpegtran_do_transform(struct jpeg_decompress_struct *src, struct jpeg_compress_struct *dst, int transform);
+static char *filename_in_dir(const char *dir, const char *filename) {
+	const char *base = strrchr(filename, '/');
+	char *result;
 
-static void update_exif_thumbnail(ExifData *ed, int transform) {
+	base = (base != NULL) ? base+1 : filename;
+	result = malloc(strlen(dir) + strlen(base) + 2);
+	sprintf(result, "%s/%s", dir, base);
+	return result;
+}
+
+/* rewrite a published jpg with optimized huffman tables, losslessly through
+   the coefficients. in place only when it gets smaller, and atomically */
+static void optimize_run(struct optimize_job *job) {
 	struct jpeg_decompress_struct src;
 	struct jpeg_compress_struct dst;
 	struct jpeg_error_mgr jsrcerr, jdsterr;
-	unsigned char *newthumb;
-	unsigned long newthumbsize;
-        newthumb = NULL;
-        newthumbsize = 0;
+	jvirt_barray_ptr *coef_arrays;
+	struct stream_checksum sum = { 0, 0 };
+	/* a copy in optimize_dir is not in <receivepath>, so it is not in the manifest */
+	struct published_file pf = { NULL, optimize_dir == NULL ? "jpg" : "optimized", 0, 0, job->transform, job->added_ms, 0,
+		(checksum_manifest == NULL || optimize_dir != NULL) ? NULL : &sum };
+	char *filename, *tmpFilename;
+	struct stat st;
+	FILE *in, *out;
+	long size;
+	int ok;
+	double start = now_ms();
 
+	in = fopen(job->filename, "rb");
+	if(in == NULL || fstat(fileno(in), &st) != 0) {
+		fprintf(stderr, "Cannot read file %s for its optimization\n", job->filename);
+		if(in != NULL) {
+			fclose(in);
+		}
+		return;
+	}
+	filename = (optimize_dir != NULL) ? filename_in_dir(optimize_dir, job->filename) : strdup(job->filename);
+	tmpFilename = malloc(strlen(filename) + 6);
+	sprintf(tmpFilename, "%s.part", filename);
+	out = fopen(tmpFilename, "wb");
+	if(out == NULL) {
+		fprintf(stderr, "Cannot create file %s\n", tmpFilename);
+		fclose(in);
+		free(tmpFilename);
+		free(filename);
+		return;
+	}
 	src.err = jpeg_std_error(&jsrcerr);
 	jpeg_create_decompress(&src);
-	jpeg_mem_src(&src, ed->data, ed->size);
-
+	jpeg_stdio_src(&src, in);
 	dst.err = jpeg_std_error(&jdsterr);
 	jpeg_create_compress(&dst);
-	jpeg_mem_dest(&dst, &newthumb, &newthumbsize);
+	if(checksum_manifest != NULL) {
+		jpeg_checksum_stdio_dest(&dst, out, &sum);
+	} else {
+		jpeg_stdio_dest(&dst, out);
+	}
 
-	jpegtran_do_transform(&src, &dst, transform);
+	jcopy_markers_setup(&src, JCOPYOPT_ALL);
+	jpeg_read_header(&src, TRUE);
+	pf.width = src.image_width;
+	pf.height = src.image_height;
+	coef_arrays = jpeg_read_coefficients(&src);
+	jpeg_copy_critical_parameters(&src, &dst);
+	dst.optimize_coding = TRUE;
+	if(optimize_mode == OPTIMIZE_PROGRESSIVE) {
+		jpeg_simple_progression(&dst);
+	}
+	jpeg_write_coefficients(&dst, coef_arrays);
+	jcopy_markers_execute(&src, &dst, JCOPYOPT_ALL);
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	fclose(in);
 
-	free(ed->data);
-	ed->data = newthumb;
-	ed->size = newthumbsize;
+	fflush(out);
+	size = ftell(out);
+	if(optimize_dir == NULL && size >= st.st_size) {
+		/* e.g. the camera optimizes already */
+		fclose(out);
+		unlink(tmpFilename);
+		free(tmpFilename);
+		free(filename);
+		return;
+	}
+	fdatasync(fileno(out));
+	ok = (fclose(out) == 0) && (rename(tmpFilename, filename) == 0);
+	if(ok) {
+		printf("  Optimized %s: %lld -> %ld bytes\n", filename, (long long) st.st_size, size);
+		if(size < st.st_size) {
+			__atomic_add_fetch(&optimize_saved_bytes, st.st_size - size, __ATOMIC_RELAXED);
+		}
+		trace_end("optimize", filename, start);
+		pf.path = filename;
+		file_published(&pf);
+	} else {
+		fprintf(stderr, "Cannot write file %s\n", filename);
+		unlink(tmpFilename);
+	}
+	free(tmpFilename);
+	free(filename);
 }
 
-static void transform_exif(struct jpeg_decompress_struct *srcinfo, int transform) {
-	jpeg_saved_marker_ptr mark;
-	ExifData *ed = NULL;
-	ExifEntry *ee;
-	unsigned char *data;
-	unsigned int size;
+static void *optimize_threadfunc(void *arg) {
+	struct optimize_job *job;
 
-	for(mark = srcinfo->marker_list; NULL != mark; mark = mark->next) {
-		if (mark->marker == JPEG_APP0 +1) {
-			ed = exif_data_new_from_data(mark->data,mark->data_length);
-			break;
+	trace_thread_name("optimizer", "");
+	thread_role(ROLE_WORKER);
+	while(TRUE) {
+		pthread_mutex_lock(&optimize_mutex);
+		while(optimize_queue.tqh_first == NULL) {
+			pthread_cond_wait(&optimize_cond, &optimize_mutex);
+		}
+		pthread_mutex_unlock(&optimize_mutex);
+
+		/* only when the downloads are idle, and the deferred rotations done */
+		while(pipeline_backlog() > 0 || __atomic_load_n(&deferred_rotations, __ATOMIC_RELAXED) > 0) {
+			usleep(DEGRADE_IDLE_POLL_MS * 1000);
 		}
+		pthread_mutex_lock(&optimize_mutex);
+		job = optimize_queue.tqh_first;
+		TAILQ_REMOVE(&optimize_queue, job, entries);
+		pthread_mutex_unlock(&optimize_mutex);
+
+		optimize_run(job);
+		__atomic_sub_fetch(&optimize_queue_depth, 1, __ATOMIC_RELAXED);
+		free(job->filename);
+		free(job);
 	}
-	if(ed == NULL) {
-		return;
+	return NULL;
+}
+
+/* libjpeg source manager reading from a stream_buffer while it is being filled */
+struct stream_source_mgr {
+	struct jpeg_source_mgr pub;
+	struct stream_buffer *sb;
+	struct stream_chunk *chunk;
+	JOCTET eoi[2];
+};
+
+static void stream_source_init(j_decompress_ptr cinfo) {
+}
+
+static boolean stream_source_fill(j_decompress_ptr cinfo) {
+	struct stream_source_mgr *src = (struct stream_source_mgr *) cinfo->src;
+
+	free(src->chunk);
+	src->chunk = stream_buffer_next(src->sb);
+	if(src->chunk == NULL) {
+		/* premature end of the download: insert a fake EOI marker */
+		WARNMS(cinfo, JWRN_JPEG_EOF);
+		src->eoi[0] = (JOCTET) 0xFF;
+		src->eoi[1] = (JOCTET) JPEG_EOI;
+		src->pub.next_input_byte = src->eoi;
+		src->pub.bytes_in_buffer = 2;
+	} else {
+		src->pub.next_input_byte = src->chunk->data;
+		src->pub.bytes_in_buffer = src->chunk->size;
 	}
+	return TRUE;
+}
 
-	/* set orientation as standard */
-	ee = exif_content_get_entry(ed->ifd[EXIF_IFD_0], EXIF_TAG_ORIENTATION);
-	if (ee != NULL) {
-		set_exif_int(ed, ee, 1);
+static void stream_source_skip(j_decompress_ptr cinfo, long num_bytes) {
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	while(num_bytes > (long) src->bytes_in_buffer) {
+		num_bytes -= (long) src->bytes_in_buffer;
+		(void) (*src->fill_input_buffer)(cinfo);
 	}
-	ee = exif_content_get_entry(ed->ifd[EXIF_IFD_1], EXIF_TAG_ORIENTATION);
-	if (ee != NULL) {
-		set_exif_int(ed, ee, 1);
+	src->next_input_byte += (size_t) num_bytes;
+	src->bytes_in_buffer -= (size_t) num_bytes;
+}
+
+static void stream_source_term(j_decompress_ptr cinfo) {
+	struct stream_source_mgr *src = (struct stream_source_mgr *) cinfo->src;
+
+	free(src->chunk);
+	src->chunk = NULL;
+}
+
+static void jpeg_stream_buffer_src(j_decompress_ptr cinfo, struct stream_buffer *sb) {
+	struct stream_source_mgr *src;
+
+	src = (struct stream_source_mgr *) (*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(struct stream_source_mgr));
+	src->pub.init_source = stream_source_init;
+	src->pub.fill_input_buffer = stream_source_fill;
+	src->pub.skip_input_data = stream_source_skip;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = stream_source_term;
+	src->pub.bytes_in_buffer = 0;
+	src->pub.next_input_byte = NULL;
+	src->sb = sb;
+	src->chunk = NULL;
+	cinfo->src = (struct jpeg_source_mgr *) src;
+}
+
+struct derivative_info {
+	struct stream_buffer *sb;
+	char *filename;
+	int transform;
+	double added_ms;
+};
+
+/* the source pixel for output pixel x,y of the rotated/flipped image */
+static void transform_source_pixel(int transform, int x, int y, int width, int height, int *sx, int *sy) {
+	switch(transform) {
+		case JXFORM_FLIP_H:	*sx = width-1-x;	*sy = y;	break;
+		case JXFORM_FLIP_V:	*sx = x;	*sy = height-1-y;	break;
+		case JXFORM_ROT_180:	*sx = width-1-x;	*sy = height-1-y;	break;
+		case JXFORM_TRANSPOSE:	*sx = y;	*sy = x;	break;
+		case JXFORM_ROT_90:	*sx = y;	*sy = height-1-x;	break;
+		case JXFORM_ROT_270:	*sx = width-1-y;	*sy = x;	break;
+		case JXFORM_TRANSVERSE:	*sx = width-1-y;	*sy = height-1-x;	break;
+		default:	*sx = x;	*sy = y;	break;
 	}
-	/* rotate the thumbnail */
-	if (ed->data && ed->data[0] == 0xff && ed->data[1] == 0xd8) {
-		update_exif_thumbnail(ed, transform);
+}
+
+/* decode the jpg at reduced IDCT scale while it downloads, and write a rotated display size copy */
+void *derivative_threadfunc(void *arg) {
+	struct derivative_info *dinfo = (struct derivative_info *) arg;
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jpeg_error_mgr jsrcerr, jdsterr;
+	unsigned char *pixels, *row;
+	JSAMPROW rowptr[1];
+	int width, height, components, outwidth, outheight;
+	int num, denom, longside, x, y, sx, sy;
+	char *tmpFilename;
+	FILE *f;
+	double trace_start_ms = trace_begin();
+
+	trace_thread_name("display copy", "");
+	thread_role(ROLE_TRANSFORM);
+	src.err = jpeg_std_error(&jsrcerr);
+	jpeg_create_decompress(&src);
+	jpeg_stream_buffer_src(&src, dinfo->sb);
+	jpeg_read_header(&src, TRUE);
+
+	/* the smallest IDCT scale which is still at least derivative_size on the long side */
+	longside = (src.image_width > src.image_height) ? src.image_width : src.image_height;
+	denom = 8;
+	for(num=1; num<denom; num++) {
+		if(longside * num/denom >= derivative_size) {
+			break;
+		}
 	}
-	/* and (guess what) modify dimension tags according to the rotation */
-	update_exif_dimension(ed, transform, srcinfo->image_width, srcinfo->image_height);
+	while(num % 2 == 0) {
+		num /= 2;
+		denom /= 2;
+	}
+	src.scale_num = num;
+	src.scale_denom = denom;
+	src.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&src);
 
-	exif_data_save_data(ed, &data, &size);
-	exif_data_unref(ed);
-	/* update jpeg APP1 (EXIF) marker */
-	mark->data = srcinfo->mem->alloc_large((j_common_ptr)srcinfo, JPOOL_IMAGE, size);
-	mark->original_length = size;
-	mark->data_length = size;
-	memcpy(mark->data,data,size);
-	free(data);
-}
+	width = src.output_width;
+	height = src.output_height;
+	components = src.output_components;
+	pixels = malloc((size_t) width * height * components);
+	while(src.output_scanline < height) {
+		rowptr[0] = &pixels[(size_t) src.output_scanline * width * components];
+		jpeg_read_scanlines(&src, rowptr, 1);
+	}
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	/* anything after the EOI marker is not needed anymore */
+	stream_buffer_close(dinfo->sb);
 
-static void jpegtran_do_transform(struct jpeg_decompress_struct *src, struct jpeg_compress_struct *dst, int transform) {
-	jvirt_barray_ptr * src_coef_arrays;
-	jvirt_barray_ptr * dst_coef_arrays;
-        jpeg_transform_info transformoption;
+	if(transform_swaps_dimensions(dinfo->transform)) {
+		outwidth = height;
+		outheight = width;
+	} else {
+		outwidth = width;
+		outheight = height;
+	}
 
-	memset(&transformoption, 0, sizeof(transformoption));
-	transformoption.transform = transform;
-        transformoption.perfect = FALSE;
-        transformoption.trim = FALSE;
-        transformoption.force_grayscale = FALSE;
-        transformoption.crop = FALSE;
+	tmpFilename = malloc(strlen(dinfo->filename) + 6);
+	sprintf(tmpFilename, "%s.part", dinfo->filename);
+	f = fopen(tmpFilename, "wb");
+	if(f != NULL) {
+		dst.err = jpeg_std_error(&jdsterr);
+		jpeg_create_compress(&dst);
+		jpeg_stdio_dest(&dst, f);
+		dst.image_width = outwidth;
+		dst.image_height = outheight;
+		dst.input_components = components;
+		dst.in_color_space = (components == 1) ? JCS_GRAYSCALE : JCS_RGB;
+		jpeg_set_defaults(&dst);
+		jpeg_set_quality(&dst, 85, TRUE);
+		jpeg_start_compress(&dst, TRUE);
+		row = malloc((size_t) outwidth * components);
+		rowptr[0] = row;
+		for(y=0; y<outheight; y++) {
+			if(dinfo->transform == JXFORM_NONE) {
+				rowptr[0] = &pixels[(size_t) y * width * components];
+			} else {
+				for(x=0; x<outwidth; x++) {
+					transform_source_pixel(dinfo->transform, x, y, width, height, &sx, &sy);
+					memcpy(&row[x * components], &pixels[((size_t) sy * width + sx) * components], components);
+				}
+			}
+			jpeg_write_scanlines(&dst, rowptr, 1);
+		}
+		jpeg_finish_compress(&dst);
+		jpeg_destroy_compress(&dst);
+		free(row);
+		if(fclose(f) == 0 && rename(tmpFilename, dinfo->filename) == 0) {
+			struct published_file pf = { dinfo->filename, "display", outwidth, outheight, dinfo->transform, dinfo->added_ms, 0, NULL };
+			printf("  Display copy %s written (%dx%d, scale %d/%d)\n", dinfo->filename, outwidth, outheight, num, denom);
+			file_published(&pf);
+		} else {
+			fprintf(stderr, "Cannot write file %s\n", dinfo->filename);
+			unlink(tmpFilename);
+		}
+	} else {
+		fprintf(stderr, "Cannot create file %s\n", tmpFilename);
+	}
+	free(tmpFilename);
+	free(pixels);
+	trace_end("display copy", dinfo->filename, trace_start_ms);
+	return NULL;
+}
 
-	jcopy_markers_setup(src, JCOPYOPT_ALL);
-        jpeg_read_header(src, TRUE);
+/* a broken live view frame is dropped, instead of ending the program */
+struct live_view_error_mgr {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
 
-	transform_exif(src, transform);
+static void live_view_error_exit(j_common_ptr cinfo) {
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(((struct live_view_error_mgr *) cinfo->err)->jmp, 1);
+}
 
-	jtransform_request_workspace(src, &transformoption);
-	src_coef_arrays = jpeg_read_coefficients(src);
-	jpeg_copy_critical_parameters(src, dst);
-	dst_coef_arrays = jtransform_adjust_parameters(src, dst, src_coef_arrays, &transformoption);
-	jpeg_write_coefficients(dst, dst_coef_arrays);
-	jcopy_markers_execute(src, dst, JCOPYOPT_ALL);
-	jtransform_execute_transformation(src, dst, src_coef_arrays, &transformoption);
+/* decode a live view frame at the largest IDCT scale which still fits
+   live_view_size, into the next slot of the shared memory ring */
+static void live_view_decode(const char *data, unsigned long size, double captured_ms) {
+	struct jpeg_decompress_struct src;
+	struct live_view_error_mgr jsrcerr;
+	struct live_view_slot *slot;
+	unsigned char *pixels;
+	JSAMPROW rowptr[1];
+	uint64_t seq = live_view->latest + 1;
+	int num, longside;
+	double start = trace_begin();
 
-	jpeg_finish_compress(dst);
-	jpeg_finish_decompress(src);
+	src.err = jpeg_std_error(&jsrcerr.pub);
+	jsrcerr.pub.error_exit = live_view_error_exit;
+	if(setjmp(jsrcerr.jmp)) {
+		jpeg_destroy_decompress(&src);
+		__atomic_add_fetch(&live_view->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	jpeg_create_decompress(&src);
+	jpeg_mem_src(&src, (unsigned char *) data, size);
+	jpeg_read_header(&src, TRUE);
+	longside = (src.image_width > src.image_height) ? src.image_width : src.image_height;
+	for(num=8; num>1; num--) {
+		if(longside * num/8 <= live_view_size) {
+			break;
+		}
+	}
+	src.scale_num = num;
+	src.scale_denom = 8;
+	src.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&src);
+	if((size_t) src.output_width * src.output_height * src.output_components > live_view->slot_size) {
+		fprintf(stderr, "Live view frame too large (%dx%d)\n", src.output_width, src.output_height);
+		jpeg_destroy_decompress(&src);
+		__atomic_add_fetch(&live_view->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
 
-	jpeg_destroy_compress(dst);
-        jpeg_destroy_decompress(src);
+	slot = &live_view->slot[seq % LIVE_VIEW_SLOTS];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	/* the pixel stores below must not become visible before the 0 (a
+	   release store only orders the stores before it) */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	pixels = (unsigned char *) live_view + slot->offset;
+	while(src.output_scanline < src.output_height) {
+		rowptr[0] = &pixels[(size_t) src.output_scanline * src.output_width * src.output_components];
+		jpeg_read_scanlines(&src, rowptr, 1);
+	}
+	slot->width = src.output_width;
+	slot->height = src.output_height;
+	slot->components = src.output_components;
+	slot->captured_ms = captured_ms;
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&live_view->latest, seq, __ATOMIC_RELEASE);
+	trace_end("live view decode", NULL, start);
 }
 
-void *jpegtransform_threadfunc(void *arg) {
-	struct jpeg_info *jpeg_trans_arg = (struct jpeg_info *) arg;
-        struct jpeg_decompress_struct src;
-        struct jpeg_compress_struct dst;
-        struct jpeg_error_mgr jsrcerr, jdsterr;
-
-	src.err = jpeg_std_error(&jsrcerr);
-	jpeg_create_decompress(&src);
-	jpeg_stdio_src(&src, jpeg_trans_arg->src);
+static void *live_view_threadfunc(void *arg) {
+	char *data;
+	unsigned long size;
+	double captured_ms;
 
-	dst.err = jpeg_std_error(&jdsterr);
-	jpeg_create_compress(&dst);
-	jpeg_stdio_dest(&dst, jpeg_trans_arg->dest);
+	trace_thread_name("live view", "");
+	thread_role(ROLE_TRANSFORM);
+	while(TRUE) {
+		pthread_mutex_lock(&live_view_mutex);
+		while(live_view_frame == NULL) {
+			pthread_cond_wait(&live_view_cond, &live_view_mutex);
+		}
+		data = live_view_frame;
+		size = live_view_frame_size;
+		captured_ms = live_view_frame_ms;
+		live_view_frame = NULL;
+		pthread_mutex_unlock(&live_view_mutex);
 
-	jpegtran_do_transform(&src, &dst, jpeg_trans_arg->transform);
+		live_view_decode(data, size, captured_ms);
+		free(data);
+	}
+	return NULL;
+}
 
-	fclose(jpeg_trans_arg->src);
-	fclose(jpeg_trans_arg->dest);
+/* create the shared memory ring, and the decoder thread */
+static int live_view_start(void) {
+	size_t slot_size = (size_t) live_view_size * live_view_size * 3;
+	size_t header_size = (sizeof(struct live_view_header) + 4095) & ~4095;
+	pthread_t thread;
+	int fd, i;
 
-        return NULL;
+	fd = shm_open(live_view_shm, O_CREAT | O_RDWR, 0644);
+	if(fd < 0 || ftruncate(fd, header_size + LIVE_VIEW_SLOTS * slot_size) != 0) {
+		fprintf(stderr, "Cannot create live view shared memory %s: %s\n", live_view_shm, strerror(errno));
+		return FALSE;
+	}
+	live_view = mmap(NULL, header_size + LIVE_VIEW_SLOTS * slot_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(live_view == MAP_FAILED) {
+		fprintf(stderr, "Cannot map live view shared memory %s: %s\n", live_view_shm, strerror(errno));
+		live_view = NULL;
+		return FALSE;
+	}
+	memset(live_view, 0, sizeof(struct live_view_header));
+	live_view->slot_size = (uint32_t) slot_size;
+	for(i=0; i<LIVE_VIEW_SLOTS; i++) {
+		live_view->slot[i].offset = (uint32_t) (header_size + i * slot_size);
+	}
+	__atomic_store_n(&live_view->magic, LIVE_VIEW_MAGIC, __ATOMIC_RELEASE);
+	pthread_create(&thread, NULL, &live_view_threadfunc, NULL);
+	pthread_detach(thread);
+	return TRUE;
 }
 
-char *get_exif_date(ExifData *ed) {
-	if(ed) {
-		ExifEntry *entry = exif_data_get_entry(ed, EXIF_TAG_DATE_TIME_ORIGINAL);
-		if(entry) {
-			char *ret = malloc(entry->size+1);
-			ret[entry->size+1] = '\0'; // just in case, to make sure that it's really \0-terminated (robustness)
-			memcpy(ret, entry->data, entry->size);
-			return ret;
+/* capture one live view frame, and hand it to the decoder. a frame which the
+   decoder has not started yet is replaced, and counts as dropped, like the
+   frames which were due while the tether loop was busy with a download */
+static void live_view_capture(struct tether_camera *tc) {
+	double interval = 1000.0 / live_view_fps;
+	double now = now_ms(), late = now - tc->live_view_next_ms;
+	CameraFile *file;
+	const char *data;
+	unsigned long size;
+	int retval, missed = (int) (late / interval);
+
+	if(missed > 0) {
+		__atomic_add_fetch(&live_view->dropped, missed, __ATOMIC_RELAXED);
+	}
+	tc->live_view_next_ms += (missed + 1) * interval;
+
+	if(gp_file_new(&file) != GP_OK) {
+		return;
+	}
+	retval = camera_capture_preview(tc, file);
+	if(retval == GP_ERROR_NOT_SUPPORTED) {
+		printf("%sLive view is not supported by the camera\n", tc->prefix);
+		tc->live_view = FALSE;
+	} else if(retval != GP_OK || gp_file_get_data_and_size(file, &data, &size) != GP_OK || size == 0) {
+		/* e.g. busy with a capture */
+		__atomic_add_fetch(&live_view->dropped, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&live_view->frames, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&live_view_mutex);
+		if(live_view_frame != NULL) {
+			free(live_view_frame);
+			__atomic_add_fetch(&live_view->dropped, 1, __ATOMIC_RELAXED);
 		}
+		live_view_frame = malloc(size);
+		memcpy(live_view_frame, data, size);
+		live_view_frame_size = size;
+		live_view_frame_ms = now;
+		pthread_cond_signal(&live_view_cond);
+		pthread_mutex_unlock(&live_view_mutex);
 	}
-	return NULL;
+	gp_file_free(file);
+	trace_end("live view frame", NULL, now);
 }
 
-int get_exif_orientation_transform(ExifData *ed) {
-	if(ed) {
-		ExifByteOrder byte_order = exif_data_get_byte_order(ed);
-		ExifEntry *entry = exif_data_get_entry(ed, EXIF_TAG_ORIENTATION);
-		if(entry) {
-			switch (exif_get_short(entry->data, byte_order)) {
-				case 8: { return JXFORM_ROT_270; }
-				case 7: { return JXFORM_TRANSVERSE; }
-				case 6: { return JXFORM_ROT_90; }
-				case 5: { return JXFORM_TRANSPOSE; }
-				case 4: { return JXFORM_FLIP_V; }
-				case 3: { return JXFORM_ROT_180; }
-				case 2: { return JXFORM_FLIP_H; }
-				case 1:
-				default: { return JXFORM_NONE; }
-			}
-		}
+/* a free descriptor, NULL when all are in use and the caller does not wait */
+static struct jpeg_info *jpeg_pool_get(struct jpeg_pool *pool, int wait) {
+	struct jpeg_info *jpeginfo = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->free_num == 0) {
+		pool->full++;
 	}
-	return JXFORM_NONE;
+	while(pool->free_num == 0 && wait) {
+		pthread_cond_wait(&pool->cond_free, &pool->mutex);
+	}
+	if(pool->free_num > 0) {
+		jpeginfo = pool->free_infos[--pool->free_num];
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return jpeginfo;
+}
+
+/* there is a descriptor for each slot, so the ring never overflows */
+static void jpeg_pool_submit(struct jpeg_pool *pool, struct jpeg_info *jpeginfo) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->ring[(pool->ring_head + pool->ring_num) % pool->num] = jpeginfo;
+	pool->ring_num++;
+	pthread_cond_signal(&pool->cond_job);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void jpeg_pool_release(struct jpeg_pool *pool, struct jpeg_info *jpeginfo) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->free_infos[pool->free_num++] = jpeginfo;
+	pthread_cond_signal(&pool->cond_free);
+	pthread_mutex_unlock(&pool->mutex);
 }
 
 void *get_jpeg_threadfunc(void *arg) {
@@ -298,33 +4413,42 @@ void *get_jpeg_threadfunc(void *arg) {
 	int c;
 	int fdfrom;
 	int fdto;
-	pthread_t thread;
+	int ok = FALSE;
+	struct download_writer writer;
+	struct derivative_info *dinfo = NULL;
+	double transfer_ms;
+	pthread_t thread, derivative_thread;
 
 	jpeginfo = (struct jpeg_info *) arg;
 	fdfrom = jpeginfo->fd_from_gphoto;
 	c = read(fdfrom, buf, sizeof(buf));
 	if(c > 0) {
-		ExifData *ed = exif_data_new_from_data(buf, c);
-		int transform = get_exif_orientation_transform(ed);
-		char *filename = get_exif_date(ed);
-		if(filename != NULL) {
-			int i;
-			for(i=strlen(filename)-1; i>= 0; i--) {
-				if (filename[i] < '0' || filename[i] > '9') {
-					filename[i] = '_';
-				}
-			}
-			filename = realloc(filename, strlen(filename) +5);
-			strcat(filename, ".jpg");
+		double sniff_start = now_ms();
+		char *date;
+		int transform = exif_sniff_jpeg(buf, c, &date);
+		int deferred_transform = JXFORM_NONE;
+		int width = 0, height = 0;
+		char *localFilename = jpeginfo->localFilename;
+		if(localFilename == NULL) {
+			char *full_filename = get_jpeg_filename_from_date(date, jpeginfo->camerafilename, jpeginfo->prefix);
+			localFilename = unique_filename(full_filename);
+			free(full_filename);
 		} else {
-			filename = strdup(jpeginfo->camerafilename);
+			free(date);
+		}
+		metrics_observe(STAGE_EXIF_SNIFF, now_ms() - sniff_start);
+		trace_end("exif sniff", jpeginfo->camerafilename, sniff_start);
+		if(transform != JXFORM_NONE && degrade_backlog > 0 && pipeline_backlog() > degrade_backlog) {
+			/* overload: the file as it is now, the rotation later */
+			printf("  Backlog of %d files, deferring the rotation of %s\n", pipeline_backlog(), jpeginfo->camerafilename);
+			deferred_transform = transform;
+			transform = JXFORM_NONE;
+		}
+		if(jpeg_buffer_dimensions(buf, c, &width, &height) && transform_swaps_dimensions(transform)) {
+			int t = width;
+			width = height;
+			height = t;
 		}
-		char *full_filename = malloc(strlen(receivedir) + strlen(filename) + 2);
-		sprintf(full_filename, "%s/%s", receivedir, filename);
-		char *localFilename = unique_filename(full_filename);
-		free(filename);
-		free(full_filename);
-		exif_data_unref(ed);
 
 		if(transform == JXFORM_NONE) {
 			printf("  Downloading %s to %s ...\n", jpeginfo->camerafilename, localFilename);
@@ -354,37 +4478,242 @@ void *get_jpeg_threadfunc(void *arg) {
 			}
 		}
 
-		if(fdto >= 0) {
-			write(fdto, buf, c);
+		/* when transforming, the checksum is taken from what libjpeg writes */
+		writer_init(&writer, fdto, transform == JXFORM_NONE);
+		if(derivativedir != NULL) {
+			dinfo = malloc(sizeof(struct derivative_info));
+			dinfo->sb = stream_buffer_new();
+			dinfo->filename = filename_in_dir(derivativedir, localFilename);
+			dinfo->transform = (deferred_transform != JXFORM_NONE) ? deferred_transform : transform;
+			dinfo->added_ms = jpeginfo->added_ms;
+			writer.tee = dinfo->sb;
+			pthread_create(&derivative_thread, NULL, &derivative_threadfunc, dinfo);
 		}
-		while(TRUE) {
-			c = read(fdfrom, buf, sizeof(buf));
-			if(c <= 0) {
-				break;
-			}
-			if(fdto >= 0) {
-				write(fdto, buf, c);
-			}
+		jpeginfo->sum.crc = 0;
+		jpeginfo->sum.size = 0;
+		writer_write(&writer, buf, c);
+		writer_copy_from(&writer, fdfrom);
+		fdfrom = -1;
+		transfer_ms = now_ms() - jpeginfo->start_ms;
+		metrics_observe(STAGE_TRANSFER, transfer_ms);
+		trace_end("jpeg stream", jpeginfo->camerafilename, sniff_start);
+		metrics_observe(STAGE_WRITE, writer.write_ms);
+		metrics_download(writer.bytes);
+		if(dinfo != NULL) {
+			stream_buffer_close(dinfo->sb);
 		}
 
 		if(fdto >= 0) {
+			if(transform == JXFORM_NONE && jpeginfo->delete_entry != NULL) {
+				fsync(fdto);
+			}
 			close(fdto);
+			ok = !writer.failed;
 		}
 		if(transform != JXFORM_NONE) {
 			pthread_join(thread, NULL);
 		}
+		if(transform != JXFORM_NONE) {
+			trace_end("wait for transform", jpeginfo->camerafilename, transfer_ms + jpeginfo->start_ms);
+		}
+		if(ok) {
+			struct published_file pf = { localFilename, "jpg", width, height, transform, jpeginfo->added_ms, transfer_ms,
+				checksum_manifest == NULL ? NULL : (transform == JXFORM_NONE) ? &writer.sum : &jpeginfo->sum, TRUE };
+			file_published(&pf);
+			if(!__atomic_load_n(&jpeginfo->download_failed, __ATOMIC_ACQUIRE)) {
+				/* only a complete download, the stream ends early when the camera fails */
+				dedup_record(&jpeginfo->dedup, &writer.head, writer.bytes);
+			}
+			if(deferred_transform != JXFORM_NONE) {
+				rotation_defer(localFilename, deferred_transform, jpeginfo->added_ms);
+			} else {
+				optimize_defer(localFilename, transform, jpeginfo->added_ms);
+			}
+		}
+		if(jpeginfo->localFilename != NULL) {
+			release_filename(localFilename);
+		}
 		free(localFilename);
-		free(jpeginfo->camerafilename);
-		free(jpeginfo);
-	}	
-	close(fdfrom);
+	} else if(jpeginfo->localFilename != NULL) {
+		release_filename(jpeginfo->localFilename);
+		free(jpeginfo->localFilename);
+	}
+	if(fdfrom >= 0) {
+		close(fdfrom);
+	}
+	if(jpeginfo->delete_entry != NULL) {
+		delete_entry_done(jpeginfo->delete_entry, ok, ok ? writer.bytes : 0);
+	}
+	if(dinfo != NULL) {
+		pthread_join(derivative_thread, NULL);
+		stream_buffer_free(dinfo->sb);
+		free(dinfo->filename);
+		free(dinfo);
+	}
+	__atomic_sub_fetch(&jpeg_inflight, 1, __ATOMIC_RELEASE);
+	jpeg_pool_release(&jpeg_pool, jpeginfo);
+	return NULL;
+}
+
+static void *jpeg_pool_threadfunc(void *arg) {
+	struct jpeg_pool *pool = (struct jpeg_pool *) arg;
+	struct jpeg_info *jpeginfo;
+
+	trace_thread_name("jpeg download", "");
+	thread_role(ROLE_USB);
+	while(TRUE) {
+		pthread_mutex_lock(&pool->mutex);
+		while(pool->ring_num == 0) {
+			pthread_cond_wait(&pool->cond_job, &pool->mutex);
+		}
+		jpeginfo = pool->ring[pool->ring_head];
+		pool->ring_head = (pool->ring_head + 1) % pool->num;
+		pool->ring_num--;
+		pthread_mutex_unlock(&pool->mutex);
+
+		get_jpeg_threadfunc(jpeginfo);
+	}
 	return NULL;
 }
 
+static void jpeg_pool_start(struct jpeg_pool *pool, int num) {
+	pthread_t thread;
+	int i;
+
+	pool->num = num;
+	pool->infos = calloc(num, sizeof(struct jpeg_info));
+	pool->free_infos = malloc(num * sizeof(struct jpeg_info *));
+	pool->ring = malloc(num * sizeof(struct jpeg_info *));
+	for(i=0; i<num; i++) {
+		pool->free_infos[i] = &pool->infos[i];
+	}
+	pool->free_num = num;
+	pool->ring_head = 0;
+	pool->ring_num = 0;
+	pool->full = 0;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond_job, NULL);
+	pthread_cond_init(&pool->cond_free, NULL);
+	for(i=0; i<num; i++) {
+		pthread_create(&thread, NULL, &jpeg_pool_threadfunc, pool);
+		pthread_detach(thread);
+	}
+}
+
+/* write a preview jpeg, rotated according to the given transform */
+static int write_preview_file(const char *data, unsigned long size, int transform, const char *previewFilename) {
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct jpeg_error_mgr jsrcerr, jdsterr;
+	char *tmpFilename;
+	FILE *f;
+	int ok;
+
+	/* write under a temporary name first, so that the preview appears atomically */
+	tmpFilename = malloc(strlen(previewFilename) + 6);
+	sprintf(tmpFilename, "%s.part", previewFilename);
+	f = fopen(tmpFilename, "wb");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot create file %s\n", tmpFilename);
+		free(tmpFilename);
+		return FALSE;
+	}
+	if(transform == JXFORM_NONE) {
+		fwrite(data, 1, size, f);
+	} else {
+		src.err = jpeg_std_error(&jsrcerr);
+		jpeg_create_decompress(&src);
+		jpeg_mem_src(&src, (unsigned char *) data, size);
+
+		dst.err = jpeg_std_error(&jdsterr);
+		jpeg_create_compress(&dst);
+		jpeg_stdio_dest(&dst, f);
+
+		jpegtran_do_transform(&src, &dst, transform);
+	}
+	ok = (fclose(f) == 0);
+	if(ok) {
+		ok = (rename(tmpFilename, previewFilename) == 0);
+	}
+	if(!ok) {
+		fprintf(stderr, "Cannot write file %s\n", previewFilename);
+		unlink(tmpFilename);
+	}
+	free(tmpFilename);
+	return ok;
+}
+
+/* the orientation of a raw file (libraw's flip) as jpeg transform */
+static int raw_flip_transform(int flip) {
+	switch(flip) {
+		case 3:	return JXFORM_ROT_180;
+		case 5:	return JXFORM_ROT_270;
+		case 6:	return JXFORM_ROT_90;
+		default:	return JXFORM_NONE;
+	}
+}
+
+/* the embedded full size jpeg of a raw file, without any demosaicing */
+static libraw_processed_image_t *get_raw_preview(libraw_data_t *libraw) {
+	libraw_processed_image_t *thumb;
+	int err;
+
+	if(libraw_unpack_thumb(libraw) != LIBRAW_SUCCESS || libraw->thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG) {
+		return NULL;
+	}
+	thumb = libraw_dcraw_make_mem_thumb(libraw, &err);
+	if(thumb != NULL && thumb->type != LIBRAW_IMAGE_JPEG) {
+		libraw_dcraw_clear_mem(thumb);
+		thumb = NULL;
+	}
+	return thumb;
+}
+
+/* publish the preview as a jpg with the name of the raw file, next to it (or in previewdir) */
+static void publish_raw_preview(libraw_processed_image_t *thumb, int transform, const char *rawFilename, double added_ms) {
+	char *jpgFilename, *unique, *ext;
+	struct published_file pf = { NULL, "preview", 0, 0, transform, added_ms, 0, NULL };
+	double start = now_ms();
+
+	if(previewdir != NULL) {
+		jpgFilename = filename_in_dir(previewdir, rawFilename);
+		jpgFilename = realloc(jpgFilename, strlen(jpgFilename) + 5);
+	} else {
+		jpgFilename = malloc(strlen(rawFilename) + 5);
+		strcpy(jpgFilename, rawFilename);
+	}
+	ext = strrchr(jpgFilename, '.');
+	if(ext == NULL || strchr(ext, '/') != NULL) {
+		ext = jpgFilename + strlen(jpgFilename);
+	}
+	strcpy(ext, ".jpg");
+	unique = unique_filename(jpgFilename);
+	if(write_preview_file((const char *) thumb->data, thumb->data_size, transform, unique)) {
+		pf.path = unique;
+		if(jpeg_buffer_dimensions(thumb->data, thumb->data_size, &pf.width, &pf.height) && transform_swaps_dimensions(transform)) {
+			int t = pf.width;
+			pf.width = pf.height;
+			pf.height = t;
+		}
+		printf("  Preview of %s published to %s in %.0f ms\n", rawFilename, unique, now_ms() - added_ms);
+		file_published(&pf);
+	}
+	trace_end("raw preview", unique, start);
+	free(jpgFilename);
+	free(unique);
+}
+
 void *do_rename_afterwards_threadfunc(void *arg) {
-	char *filename = (char *) arg;
+	struct rename_info *renameinfo = (struct rename_info *) arg;
+	char *filename = renameinfo->filename;
+	double start = now_ms();
+	libraw_data_t *libraw;
+	libraw_processed_image_t *thumb = NULL;
+	int thumb_transform = JXFORM_NONE;
 	ExifData *ed;
 	char *datestr = NULL;
+	struct published_file pf = { filename, "other", 0, 0, JXFORM_NONE, renameinfo->added_ms, renameinfo->transfer_ms,
+		checksum_manifest == NULL ? NULL : &renameinfo->sum, TRUE };
 
 	ed = exif_data_new_from_file(filename);
 	if(ed)	{
@@ -405,25 +4734,32 @@ void *do_rename_afterwards_threadfunc(void *arg) {
 		libraw = libraw_init(0);
 		if (libraw_open_file(libraw, filename) == LIBRAW_SUCCESS) {
 			time_t t = libraw->other.timestamp;
+			pf.type = "raw";
+			pf.width = libraw->sizes.width;
+			pf.height = libraw->sizes.height;
 			if(t > 0) {
 				datestr = malloc(20);
 				strftime(datestr, 20, "%Y_%m_%d_%H_%M_%S", localtime(&t));
 /*				printf("##Raw Date %s\n", datestr);*/
 			}
+			if(raw_preview) {
+				thumb = get_raw_preview(libraw);
+				thumb_transform = raw_flip_transform(libraw->sizes.flip);
+			}
 #if LIBRAW_MINOR_VERSION != 14
 			libraw_recycle_datastream(libraw);
 #endif
 		} else {
 			printf("File not readable or no EXIF data / no recognizable libraw data in file %s\n", filename);
 		}
-		libraw_recycle(libraw);
+		libraw_close(libraw);
 	}
 	if(datestr != NULL && strlen(datestr) > 0) {
 		char *newfilename, *ext, *unique;
 		int num;
 		ext = malloc(strlen(filename)+1);
 		ext[0] = '\0';
-		newfilename = malloc(strlen(filename)+strlen(datestr)+1); // that should be more than enough
+		newfilename = malloc(strlen(filename)+strlen(renameinfo->prefix)+strlen(datestr)+1); // that should be more than enough
 		strcpy(newfilename, filename);
 		for(num=strlen(newfilename)-1; num > 0; num--) {
 			if(newfilename[num] == '.') {
@@ -438,83 +4774,332 @@ void *do_rename_afterwards_threadfunc(void *arg) {
 			}
 			num--;
 		}
+		strcat(newfilename, renameinfo->prefix);
 		strcat(newfilename, datestr);
 		strcat(newfilename, ext);
 		unique = unique_filename(newfilename);
 		printf("  Renaming received file %s to %s\n", filename, unique);
-		rename(filename, unique);
+		if(rename(filename, unique) == 0) {
+			pf.path = unique;
+		}
+		if(thumb != NULL) {
+			publish_raw_preview(thumb, thumb_transform, pf.path, renameinfo->added_ms);
+		}
+		file_published(&pf);
 		free(ext);
 		free(newfilename);
 		free(unique);
 		free(datestr);
+	} else {
+		if(thumb != NULL) {
+			publish_raw_preview(thumb, thumb_transform, pf.path, renameinfo->added_ms);
+		}
+		file_published(&pf);
 	}
+	if(thumb != NULL) {
+		libraw_dcraw_clear_mem(thumb);
+	}
+	metrics_observe(STAGE_RENAME, now_ms() - start);
+	trace_end("rename", filename, start);
 	free(filename);
+	free(renameinfo);
 	return NULL;
 }
 
-void get_jpeg_file(Camera *camera, GPContext *context, CameraFilePath *path) {
+static void delete_file(struct tether_camera *tc, CameraFilePath *path) {
+	double start = now_ms();
+
+	printf("  Deleting %s on camera...\n", path->name);
+	if(camera_file_delete(tc, path->folder, path->name) != GP_OK) {
+		metrics_error(ERROR_DELETE);
+	} else if(catch_up) {
+		/* a camera which reuses the name (e.g. capt0000.jpg) gets it downloaded again */
+		journal_mark(&tc->journal, path, JOURNAL_DELETED);
+	}
+	metrics_observe(STAGE_DELETE, now_ms() - start);
+	trace_end("delete", path->name, start);
+}
+
+/* look the file up in the duplicate index. only a name which has been
+   downloaded before costs a usb round trip: the first bytes (as many as the
+   index has of it) are read from the camera and compared. a match is not
+   downloaded again, but it is left on the camera, as the rest of the file
+   has not been compared */
+static int skip_duplicate(struct tether_camera *tc, CameraFilePath *path, struct dedup_key *key) {
+	struct dedup_entry *de;
+	struct stream_checksum head;
+	uint64_t size = 0, headsize = 0;
+	uint32_t headcrc = 0;
+	char *buf;
+	int found = FALSE;
+
+	key->name[0] = '\0';
+	key->size = 0;
+	if(!skip_duplicates) {
+		return FALSE;
+	}
+	snprintf(key->name, sizeof(key->name), "%s%s", tc->prefix, path->name);
+
+	pthread_mutex_lock(&dedup_mutex);
+	for(de = dedup_find(key->name, NULL); de != NULL; de = dedup_find(key->name, de)) {
+		if(de->head.size > size) {
+			size = de->head.size;
+		}
+	}
+	pthread_mutex_unlock(&dedup_mutex);
+	if(size == 0) {
+		return FALSE;
+	}
+	buf = malloc(size);
+	if(camera_file_read(tc, path->folder, path->name, 0, buf, &size) != GP_OK) {
+		free(buf);
+		return FALSE;
+	}
+	pthread_mutex_lock(&dedup_mutex);
+	for(de = dedup_find(key->name, NULL); de != NULL && !found; de = dedup_find(key->name, de)) {
+		if(de->head.size > size) {
+			continue;	/* the file on the camera is shorter */
+		}
+		if(de->head.size != headsize) {
+			head.crc = 0;
+			head.size = 0;
+			checksum_update(&head, (unsigned char *) buf, de->head.size);
+			headsize = de->head.size;
+			headcrc = head.crc;
+		}
+		found = (headcrc == de->head.crc);
+	}
+	pthread_mutex_unlock(&dedup_mutex);
+	free(buf);
+	if(!found) {
+		printf("  %s has the name of a downloaded file, but not its content\n", path->name);
+		return FALSE;
+	}
+
+	printf("%s%s/%s was downloaded before, skipping it (it stays on the camera)\n", tc->prefix, path->folder, path->name);
+	__atomic_add_fetch(&duplicates_skipped, 1, __ATOMIC_RELAXED);
+	if(catch_up) {
+		/* left alone by the next scans, like a file from before the first run */
+		journal_mark(&tc->journal, path, JOURNAL_KNOWN);
+	}
+	return TRUE;
+}
+
+/* fetch and publish the embedded preview of a jpg, and determine (and reserve)
+   the final filename so that the full resolution download can follow later */
+char *get_jpeg_preview(struct tether_camera *tc, CameraFilePath *path, double added_ms) {
+	CameraFile *preview, *exif;
+	const char *data;
+	unsigned long size;
+	ExifData *ed = NULL;
+	char *full_filename, *localFilename, *previewFilename;
+	int transform;
+
+	if(gp_file_new(&preview) != GP_OK) {
+		return NULL;
+	}
+	if(camera_file_get(tc, path->folder, path->name, GP_FILE_TYPE_PREVIEW, preview) != GP_OK ||
+	   gp_file_get_data_and_size(preview, &data, &size) != GP_OK || size == 0) {
+		gp_file_free(preview);
+		return NULL;
+	}
+
+	/* the preview often has no exif data, so ask the camera for it separately */
+	if(gp_file_new(&exif) == GP_OK) {
+		const char *exifdata;
+		unsigned long exifsize;
+		if(camera_file_get(tc, path->folder, path->name, GP_FILE_TYPE_EXIF, exif) == GP_OK &&
+		   gp_file_get_data_and_size(exif, &exifdata, &exifsize) == GP_OK && exifsize > 0) {
+			ed = exif_data_new_from_data((const unsigned char *) exifdata, exifsize);
+		}
+		gp_file_free(exif);
+	}
+	if(ed == NULL) {
+		ed = exif_data_new_from_data((const unsigned char *) data, size);
+	}
+	transform = get_exif_orientation_transform(ed);
+	full_filename = get_jpeg_filename(ed, path->name, tc->prefix);
+	localFilename = unique_filename(full_filename);
+	reserve_filename(localFilename);
+	free(full_filename);
+	if(ed) {
+		exif_data_unref(ed);
+	}
+
+	previewFilename = filename_in_dir(previewdir, localFilename);
+	if(write_preview_file(data, size, transform, previewFilename)) {
+		struct published_file pf = { previewFilename, "preview", 0, 0, transform, added_ms, 0, NULL };
+		if(jpeg_buffer_dimensions((const unsigned char *) data, size, &pf.width, &pf.height) && transform_swaps_dimensions(transform)) {
+			int t = pf.width;
+			pf.width = pf.height;
+			pf.height = t;
+		}
+		printf("  Preview of %s published to %s in %.0f ms\n", path->name, previewFilename, now_ms() - added_ms);
+		file_published(&pf);
+	}
+	free(previewFilename);
+	gp_file_free(preview);
+	return localFilename;
+}
+
+/* download a jpg through one of the jpeg threads. returns FALSE (and keeps
+   path and localFilename) when all threads are busy and may_spill is set */
+int get_jpeg_file(struct tether_camera *tc, CameraFilePath *path, char *localFilename, double added_ms, struct dedup_key *dedup, int may_spill) {
 	int retval;
 	CameraFile *file;
+	struct delete_entry *deletes_entry = NULL;
+	struct jpeg_info *jpeginfo;
 	int gpipe[2];
 
+	jpeginfo = jpeg_pool_get(&jpeg_pool, !may_spill);
+	if(jpeginfo == NULL) {
+		printf("  All jpeg threads busy, queueing %s\n", path->name);
+		return FALSE;
+	}
 	pipe(gpipe);
 	retval = gp_file_new_from_fd(&file, gpipe[1]);
 	if(retval == GP_OK) {
-		struct jpeg_info *jpeginfo = malloc(sizeof(struct jpeg_info));
-		jpeginfo->camerafilename = strdup(path->name);
+		__atomic_add_fetch(&jpeg_inflight, 1, __ATOMIC_RELAXED);
+		snprintf(jpeginfo->camerafilename, sizeof(jpeginfo->camerafilename), "%s", path->name);
+		jpeginfo->prefix = tc->prefix;
+		jpeginfo->added_ms = added_ms;
+		jpeginfo->start_ms = now_ms();
 		jpeginfo->fd_from_gphoto = gpipe[0];
+		jpeginfo->localFilename = localFilename;
+		jpeginfo->delete_entry = NULL;
+		jpeginfo->dedup = *dedup;
+		jpeginfo->download_failed = FALSE;
+		if(deferred_delete) {
+			/* queued before the download starts, but only marked safe when the file is on disk */
+			deletes_entry = delete_queue_add(&tc->deletes, path, FALSE);
+			jpeginfo->delete_entry = deletes_entry;
+		}
 
-		pthread_t thread;
-		pthread_attr_t print_thread_attrs;
-		pthread_attr_init(&print_thread_attrs);
-		pthread_create(&thread, &print_thread_attrs, &get_jpeg_threadfunc, jpeginfo);
-		pthread_detach(thread); /* because no need to join this one later */
-		pthread_attr_destroy(&print_thread_attrs);
-
-		retval = gp_camera_file_get(camera, path->folder, path->name,
-			     GP_FILE_TYPE_NORMAL, file, context);
-		if (retval == GP_OK) {
-			printf("  Deleting %s on camera...\n", path->name);
-			gp_camera_file_delete(camera, path->folder, path->name, context);
-			gp_file_free(file);
+		jpeg_pool_submit(&jpeg_pool, jpeginfo);
+
+		retval = camera_file_get(tc, path->folder, path->name,
+			     GP_FILE_TYPE_NORMAL, file);
+		if (retval == GP_OK && catch_up) {
+			journal_mark(&tc->journal, path, JOURNAL_DONE);
 		}
+		if (retval == GP_OK && !deferred_delete) {
+			delete_file(tc, path);
+		}
+		if (retval != GP_OK) {
+			metrics_error(ERROR_DOWNLOAD);
+		}
+		if (retval != GP_OK && deletes_entry != NULL) {
+			pthread_mutex_lock(&tc->deletes.mutex);
+			deletes_entry->download_failed = TRUE;
+			pthread_mutex_unlock(&tc->deletes.mutex);
+		}
+		/* the download thread reads the pipe until its end, so it is still there */
+		__atomic_store_n(&jpeginfo->download_failed, retval != GP_OK, __ATOMIC_RELEASE);
+		gp_file_free(file);	/* closes the pipe, so the download thread can finish */
 	} else {
 		close(gpipe[1]);
 		close(gpipe[0]);
+		jpeg_pool_release(&jpeg_pool, jpeginfo);
+		if(localFilename != NULL) {
+			release_filename(localFilename);
+			free(localFilename);
+		}
 	}
 	free(path);
+	return TRUE;
+}
+
+struct any_info {
+	int fd_from_gphoto;
+	struct download_writer writer;
+};
+
+void *get_any_threadfunc(void *arg) {
+	struct any_info *anyinfo = (struct any_info *) arg;
+	double start = trace_begin();
+
+	trace_thread_name("raw writer", "");
+	thread_role(ROLE_USB);
+	writer_copy_from(&anyinfo->writer, anyinfo->fd_from_gphoto);
+	trace_end("raw stream", NULL, start);
+	return NULL;
 }
 
-void get_any_file(Camera *camera, GPContext *context, CameraFilePath *path) {
+void get_any_file(struct tether_camera *tc, CameraFilePath *path, double added_ms, struct dedup_key *dedup) {
 	int fd, retval;
 	CameraFile *file;
 	char *filename;
 	char *unique;
+	int gpipe[2];
+	struct any_info anyinfo;
+	double start_ms;
+	pthread_t thread;
 
-	filename = malloc(strlen(path->name)+strlen(receivedir)+2);
-	sprintf(filename, "%s/%s", receivedir, path->name);
+	filename = malloc(strlen(path->name)+strlen(tc->prefix)+strlen(receivedir)+2);
+	sprintf(filename, "%s/%s%s", receivedir, tc->prefix, path->name);
 	unique = unique_filename(filename);
 
 	fd = open(unique, O_CREAT | O_WRONLY, 0666);
-	retval = gp_file_new_from_fd(&file, fd);
+	if(fd < 0) {
+		fprintf(stderr, "Cannot create file %s\n", unique);
+		free(filename);
+		free(unique);
+		free(path);
+		return;
+	}
+	/* the download goes through a pipe to our own writer, which sees each buffer exactly once */
+	pipe(gpipe);
+	retval = gp_file_new_from_fd(&file, gpipe[1]);
 	if(retval == GP_OK) {
+		anyinfo.fd_from_gphoto = gpipe[0];
+		writer_init(&anyinfo.writer, fd, TRUE);
+		/* the mirrors copy the file right after, from the page cache */
+		anyinfo.writer.drop_cache = (mirrors_num == 0);
+		pthread_create(&thread, NULL, &get_any_threadfunc, &anyinfo);
+
 		printf("  Downloading %s from %s to %s ...\n", path->name, path->folder, unique);
-		retval = gp_camera_file_get(camera, path->folder, path->name,
-			     GP_FILE_TYPE_NORMAL, file, context);
+		start_ms = now_ms();
+		retval = camera_file_get(tc, path->folder, path->name,
+			     GP_FILE_TYPE_NORMAL, file);
+		gp_file_free(file);	/* closes the pipe, so the writer can finish */
+		pthread_join(thread, NULL);
+		if(retval != GP_OK) {
+			metrics_error(ERROR_DOWNLOAD);
+		}
+		if(anyinfo.writer.failed) {
+			retval = GP_ERROR;
+		}
+		metrics_observe(STAGE_TRANSFER, now_ms() - start_ms);
+		trace_end("get any file", path->name, start_ms);
+		metrics_observe(STAGE_WRITE, anyinfo.writer.write_ms);
+		metrics_download(anyinfo.writer.bytes);
 		if (retval == GP_OK) {
-			printf("  Deleting %s on camera...\n", path->name);
-			gp_camera_file_delete(camera, path->folder, path->name, context);
-
-			/* can do the do_rename_afterwards in separate thread to be back on the USB line asap */
-			pthread_t thread;
-			pthread_attr_t print_thread_attrs;
-			pthread_attr_init(&print_thread_attrs);
-			pthread_create(&thread, &print_thread_attrs, &do_rename_afterwards_threadfunc, strdup(unique));
-			pthread_detach(thread); /* because no need to join this one later */
-			pthread_attr_destroy(&print_thread_attrs);
-		}
-		gp_file_free(file);
+			if(catch_up) {
+				journal_mark(&tc->journal, path, JOURNAL_DONE);
+			}
+			dedup_record(dedup, &anyinfo.writer.head, anyinfo.writer.bytes);
+			if(deferred_delete) {
+				fsync(fd);
+				delete_entry_done(delete_queue_add(&tc->deletes, path, FALSE), TRUE, anyinfo.writer.bytes);
+			} else {
+				delete_file(tc, path);
+			}
+
+			/* can do the do_rename_afterwards in a worker thread to be back on the USB line asap */
+			struct rename_info *renameinfo = malloc(sizeof(struct rename_info));
+			renameinfo->filename = strdup(unique);
+			renameinfo->prefix = tc->prefix;
+			renameinfo->sum = anyinfo.writer.sum;
+			renameinfo->added_ms = added_ms;
+			renameinfo->transfer_ms = now_ms() - start_ms;
+			close(fd);
+			work_pool_submit(&workers, &do_rename_afterwards_threadfunc, renameinfo);
+		} else {
+			close(fd);
+		}
 	} else {
+		close(gpipe[0]);
+		close(gpipe[1]);
 		close(fd);
 	}
 	free(filename);
@@ -522,10 +5107,107 @@ void get_any_file(Camera *camera, GPContext *context, CameraFilePath *path) {
 	free(path);
 }
 
-static void camera_tether(Camera *camera, GPContext *context) {
+/* collect all files on the camera, below folder. returns the gphoto error
+   of the first folder which cannot be listed */
+static int camera_list_all(struct tether_camera *tc, const char *folder, CameraFilePath ***paths, int *num) {
+	CameraList *files, *folders;
+	const char *name;
+	char *subfolder;
+	int i, retval;
+
+	gp_list_new(&files);
+	gp_list_new(&folders);
+	retval = camera_folder_list(tc, folder, files, folders);
+	if(retval == GP_OK) {
+		for(i=0; i<gp_list_count(files); i++) {
+			gp_list_get_name(files, i, &name);
+			*paths = realloc(*paths, (*num + 1) * sizeof(CameraFilePath *));
+			(*paths)[*num] = malloc(sizeof(CameraFilePath));
+			snprintf((*paths)[*num]->folder, sizeof((*paths)[*num]->folder), "%s", folder);
+			snprintf((*paths)[*num]->name, sizeof((*paths)[*num]->name), "%s", name);
+			(*num)++;
+		}
+		for(i=0; i<gp_list_count(folders) && retval == GP_OK; i++) {
+			gp_list_get_name(folders, i, &name);
+			subfolder = malloc(strlen(folder) + strlen(name) + 2);
+			sprintf(subfolder, "%s%s%s", folder, strcmp(folder, "/") == 0 ? "" : "/", name);
+			retval = camera_list_all(tc, subfolder, paths, num);
+			free(subfolder);
+		}
+	}
+	gp_list_free(files);
+	gp_list_free(folders);
+	return retval;
+}
+
+/* compare the files on the camera with the journal, and return the ones which
+   still have to be downloaded. on the very first run, the files which are
+   already on the camera are only recorded, like without the journal */
+static int camera_catch_up(struct tether_camera *tc, CameraFilePath ***missing) {
+	struct download_journal *j = &tc->journal;
+	struct journal_entry *je;
+	CameraFilePath **paths = NULL;
+	int i, retval, num = 0, missing_num = 0;
+	double start = now_ms();
+
+	*missing = NULL;
+	for(je = j->head.tqh_first; je != NULL; je = je->entries.tqe_next) {
+		/* the queue of the last connection is gone */
+		je->queued = FALSE;
+	}
+	if(tc->sim != NULL) {
+		return 0;
+	}
+	retval = camera_list_all(tc, "/", &paths, &num);
+	if(retval != GP_OK) {
+		/* an incomplete list would look like deleted files, and the
+		   compaction would forget the known ones. try again on the next connect */
+		printf("%sCatch-up scan failed: %s\n", tc->prefix, gp_result_as_string(retval));
+		for(i=0; i<num; i++) {
+			free(paths[i]);
+		}
+		free(paths);
+		return 0;
+	}
+	for(i=0; i<num; i++) {
+		je = journal_find(j, paths[i]);
+		if(je == NULL && !j->existed) {
+			je = journal_set(j, paths[i], JOURNAL_KNOWN);
+		}
+		if(je == NULL || je->state == JOURNAL_PENDING) {
+			je = journal_set(j, paths[i], JOURNAL_PENDING);
+			je->queued = TRUE;
+			*missing = realloc(*missing, (missing_num + 1) * sizeof(CameraFilePath *));
+			(*missing)[missing_num++] = paths[i];
+		} else {
+			if(je->state == JOURNAL_DONE && !deferred_delete) {
+				/* downloaded, but we did not get to delete it before the disconnect */
+				delete_file(tc, paths[i]);
+			} else {
+				je->seen = TRUE;
+			}
+			free(paths[i]);
+			continue;
+		}
+		je->seen = TRUE;
+	}
+	free(paths);
+	journal_compact(j);
+	metrics_observe(STAGE_CATCH_UP, now_ms() - start);
+	trace_end("catch-up scan", NULL, start);
+	printf("%sCatch-up: %d files on the camera, %d to download (scan took %.0f ms)\n",
+		tc->prefix, num, missing_num, now_ms() - start);
+	return missing_num;
+}
+
+static void camera_tether(struct tether_camera *tc) {
 	TAILQ_HEAD(tailhead, entry) head;
 	struct entry {
 		CameraFilePath	*cfp;
+		char	*jpegFilename;	/* for jpgs queued after their preview */
+		int	jpeg;
+		double	added_ms;
+		struct dedup_key	dedup;
 		TAILQ_ENTRY(entry)	entries;         /* Tail queue. */
 	};
 
@@ -534,29 +5216,162 @@ static void camera_tether(Camera *camera, GPContext *context) {
 	CameraFilePath	*path;
 	void	*evtdata;
 	struct entry *e;
+	struct dedup_key	dedup;
+	double	added_ms, wait_start, idle_since = now_ms();
 
 	TAILQ_INIT(&head);                      /* Initialize the queue. */
 
-	printf("Tethering...\n");
+	if(catch_up) {
+		CameraFilePath **missing;
+		int i, num = camera_catch_up(tc, &missing);
+
+		added_ms = now_ms();
+		for(i=0; i<num; i++) {
+			/* in the queue like the raws, but with the jpgs first */
+			struct entry *raw;
+			if(skip_duplicate(tc, missing[i], &dedup)) {
+				free(missing[i]);
+				continue;
+			}
+			e = malloc(sizeof(struct entry));
+			e->cfp = missing[i];
+			e->dedup = dedup;
+			e->jpegFilename = NULL;
+			e->jpeg = (strcasecmp(&missing[i]->name[strlen(missing[i]->name) -4], ".jpg") == 0);
+			e->added_ms = added_ms;
+			raw = NULL;
+			if(e->jpeg) {
+				for(raw = head.tqh_first; raw != NULL && raw->jpeg; raw = raw->entries.tqe_next);
+			}
+			if(raw != NULL) {
+				TAILQ_INSERT_BEFORE(raw, e, entries);
+			} else {
+				TAILQ_INSERT_TAIL(&head, e, entries);
+			}
+			tc->raw_queue_depth++;
+		}
+		free(missing);
+	}
+
+	printf("%sTethering...\n", tc->prefix);
+	tc->live_view = (live_view != NULL);
+	tc->live_view_next_ms = now_ms();
 
 	while (1) {
+		int timeout = 86400000;
+		camera_commands_run(tc, head.tqh_first == NULL);
+		if(tc->live_view && now_ms() >= tc->live_view_next_ms) {
+			/* at most one frame in between two events or downloads */
+			live_view_capture(tc);
+		}
+		if(head.tqh_first != NULL) {
+			timeout = 0;
+		} else if(deferred_delete && delete_queue_pending(&tc->deletes)) {
+			timeout = DELETE_IDLE_TIMEOUT_MS;
+		}
+		if(tc->sim != NULL && timeout > 1000) {
+			/* look for a stalled benchmark once a second */
+			timeout = 1000;
+		}
+		if(tc->sim != NULL && timeout > BENCH_DRAIN_POLL_MS && __atomic_load_n(&bench_downloads_done, __ATOMIC_ACQUIRE)) {
+			timeout = BENCH_DRAIN_POLL_MS;
+		}
+		if(camera_commands_used && timeout > CAMERA_COMMAND_POLL_MS) {
+			/* a queued command cannot interrupt the wait */
+			timeout = CAMERA_COMMAND_POLL_MS;
+		}
+		if(tc->live_view && timeout > 0) {
+			double due = tc->live_view_next_ms - now_ms();
+			if(due < timeout) {
+				timeout = (due > 0) ? (int) due : 0;
+			}
+		}
 		evtdata = NULL;
-		retval = gp_camera_wait_for_event (camera, (head.tqh_first != NULL) ? 0 : 86400000, &evttype, &evtdata, context);
-		if (retval != GP_OK)
+		wait_start = now_ms();
+		retval = camera_wait_for_event(tc, timeout, &evttype, &evtdata, &added_ms);
+		if (retval != GP_OK) {
+			metrics_error(ERROR_EVENT);
 			break;
+		}
+		if(timeout == 0 || evttype != GP_EVENT_TIMEOUT) {
+			/* not when idle-waiting, only the cost of the call itself is interesting */
+			metrics_observe(STAGE_EVENT_WAIT, now_ms() - wait_start);
+			trace_end("wait for event", NULL, wait_start);
+		}
+		if(tc->sim != NULL) {
+			if(__atomic_load_n(&bench_downloads_done, __ATOMIC_ACQUIRE)
+					&& __atomic_load_n(&jpeg_inflight, __ATOMIC_ACQUIRE) == 0) {
+				/* every download is published and no display copy is in flight any more */
+				bench_report();
+				exit(0);
+			}
+			if(evttype != GP_EVENT_TIMEOUT || head.tqh_first != NULL) {
+				idle_since = now_ms();
+			} else if(simulated_camera_finished(tc->sim) && now_ms() - idle_since > BENCH_IDLE_TIMEOUT_MS) {
+				printf("Benchmark stalled, not all files were published.\n");
+				bench_report();
+				exit(1);
+			}
+		}
 		switch (evttype) {
 		case GP_EVENT_FILE_ADDED:
 			path = (CameraFilePath*)evtdata;
+			if(path && command_socket != NULL) {
+				trigger_file_added(tc, path, added_ms);
+			}
+			if(path && catch_up) {
+				struct journal_entry *je = journal_find(&tc->journal, path);
+				if(je != NULL && je->state == JOURNAL_PENDING && je->queued) {
+					/* already queued by the catch-up scan */
+					free(path);
+					break;
+				}
+				journal_mark(&tc->journal, path, JOURNAL_PENDING);
+				journal_find(&tc->journal, path)->queued = TRUE;
+			}
+			if(path && skip_duplicate(tc, path, &dedup)) {
+				free(path);
+				break;
+			}
 			if(path) {
 				CameraFilePath *pathcopy = malloc(sizeof(CameraFilePath));
 				memcpy(pathcopy, path, sizeof(CameraFilePath));
-				printf("File added on the camera: %s/%s\n", path->folder, path->name);
+				printf("%sFile added on the camera: %s/%s\n", tc->prefix, path->folder, path->name);
 				if(strcasecmp(&path->name[strlen(path->name) -4], ".jpg") == 0) {
-					get_jpeg_file(camera, context, pathcopy);
+					char *jpegFilename = NULL;
+					if(previewdir != NULL) {
+						jpegFilename = get_jpeg_preview(tc, path, added_ms);
+						trace_end("preview", path->name, added_ms);
+					}
+					if(jpegFilename == NULL && get_jpeg_file(tc, pathcopy, NULL, added_ms, &dedup, jpeg_full_policy == JPEG_FULL_SPILL)) {
+						trace_end("get jpeg file", path->name, added_ms);
+					} else {
+						/* full resolution download goes behind the previews (or the jpgs
+						   for which no jpeg thread was free), but before the raws */
+						struct entry *raw;
+						e = malloc(sizeof(struct entry));
+						e->cfp = pathcopy;
+						e->jpegFilename = jpegFilename;
+						e->jpeg = TRUE;
+						e->added_ms = added_ms;
+						e->dedup = dedup;
+						for(raw = head.tqh_first; raw != NULL && raw->jpeg; raw = raw->entries.tqe_next);
+						if(raw != NULL) {
+							TAILQ_INSERT_BEFORE(raw, e, entries);
+						} else {
+							TAILQ_INSERT_TAIL(&head, e, entries);
+						}
+						tc->raw_queue_depth++;
+					}
 				} else {
 					e = malloc(sizeof(struct entry));      /* Insert at the head. */
 					e->cfp = pathcopy;
+					e->jpegFilename = NULL;
+					e->jpeg = FALSE;
+					e->added_ms = added_ms;
+					e->dedup = dedup;
 					TAILQ_INSERT_TAIL(&head, e, entries);
+					tc->raw_queue_depth++;
 				}
 				free(path);
 			}
@@ -578,9 +5393,24 @@ static void camera_tether(Camera *camera, GPContext *context) {
 /*			printf("Timeout.\n");*/
 			e = head.tqh_first;
 			if(e != NULL) {
-				get_any_file(camera, context, e->cfp);
+				TAILQ_REMOVE(&head, e, entries);
+				tc->raw_queue_depth--;
+				if(e->jpeg) {
+					double start = trace_begin();
+					get_jpeg_file(tc, e->cfp, e->jpegFilename, e->added_ms, &e->dedup, FALSE);
+					trace_end("get jpeg file", NULL, start);
+				} else {
+					get_any_file(tc, e->cfp, e->added_ms, &e->dedup);
+				}
 				free(e);
-				TAILQ_REMOVE(&head, head.tqh_first, entries);
+			}
+			if(deferred_delete) {
+				if(head.tqh_first == NULL) {
+					/* idle: no more downloads waiting */
+					delete_queue_run(&tc->deletes, tc, delete_batch_size);
+				} else if(tc->deletes.safe_count >= delete_batch_size) {
+					delete_queue_run(&tc->deletes, tc, delete_batch_size);
+				}
 			}
 			if(evtdata) {
 				free(evtdata);
@@ -602,44 +5432,771 @@ static void camera_tether(Camera *camera, GPContext *context) {
 			break;
 		}
 	}
+
+	/* disconnected: the queued downloads are gone with the connection (with
+	   --catch-up, they are still pending in the journal, and the scan after
+	   the reconnect queues them again) */
+	while((e = head.tqh_first) != NULL) {
+		TAILQ_REMOVE(&head, e, entries);
+		if(e->jpegFilename != NULL) {
+			/* its preview is published already, but not the full resolution */
+			printf("%sDisconnected before the download of %s to %s%s\n", tc->prefix, e->cfp->name, e->jpegFilename,
+				catch_up ? ", it is caught up after the reconnect" : "");
+			release_filename(e->jpegFilename);
+			free(e->jpegFilename);
+		}
+		free(e->cfp);
+		free(e);
+	}
+	tc->raw_queue_depth = 0;
 }
 
-int main(int argc, char **argv) {
-	Camera	*camera;
-	int	retval;
+/* the udev events come after the device permissions are set up, the kernel
+   events (when there is no udev) right away. both are "KEY=value" strings,
+   the udev ones behind a header */
+static void *hotplug_threadfunc(void *arg) {
+	char buf[8192];
+	const char *action, *subsystem, *devtype, *product;
+	int busnum, devnum;
+	struct hotplug_device dev;
+	char *p, *end;
+	unsigned int offset;
+	ssize_t len;
 
-	if (argc>2) {
-		printf("Usage: %s <receivepath>\n", argv[0]);
-		exit(1);
+	while((len = recv(hotplug_fd, buf, sizeof(buf) - 1, 0)) >= 0) {
+		if(len == 0) {
+			continue;
+		}
+		buf[len] = '\0';
+		end = buf + len;
+		if(len >= 32 && strcmp(buf, "libudev") == 0) {
+			memcpy(&offset, buf + 16, sizeof(offset));	/* properties_off */
+			if(offset >= len) {
+				continue;
+			}
+			p = buf + offset;
+		} else {
+			p = buf + strlen(buf) + 1;	/* skip "add@/devices/..." */
+		}
+		action = subsystem = devtype = product = "";
+		busnum = devnum = -1;
+		for(; p < end; p += strlen(p) + 1) {
+			if(strncmp(p, "ACTION=", 7) == 0) {
+				action = p + 7;
+			} else if(strncmp(p, "SUBSYSTEM=", 10) == 0) {
+				subsystem = p + 10;
+			} else if(strncmp(p, "DEVTYPE=", 8) == 0) {
+				devtype = p + 8;
+			} else if(strncmp(p, "PRODUCT=", 8) == 0) {
+				product = p + 8;
+			} else if(strncmp(p, "BUSNUM=", 7) == 0) {
+				busnum = atoi(p + 7);
+			} else if(strncmp(p, "DEVNUM=", 7) == 0) {
+				devnum = atoi(p + 7);
+			}
+		}
+		if(strcmp(action, "add") != 0 || strcmp(subsystem, "usb") != 0 || strcmp(devtype, "usb_device") != 0 ||
+				sscanf(product, "%x/%x", &dev.vendor, &dev.product) != 2 || busnum < 0 || devnum < 0) {
+			continue;
+		}
+		snprintf(dev.port, sizeof(dev.port), "usb:%03d,%03d", busnum, devnum);
+		pthread_mutex_lock(&hotplug_mutex);
+		hotplug_last = dev;
+		hotplug_generation++;
+		pthread_cond_broadcast(&hotplug_cond);
+		pthread_mutex_unlock(&hotplug_mutex);
+	}
+	fprintf(stderr, "Lost the usb hotplug events, reconnecting by polling only\n");
+	close(hotplug_fd);
+	hotplug_fd = -1;
+	return NULL;
+}
+
+static int hotplug_start(void) {
+	struct sockaddr_nl addr;
+	pthread_t thread;
+
+	hotplug_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if(hotplug_fd < 0) {
+		fprintf(stderr, "No usb hotplug events, reconnecting by polling only\n");
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1 | 2;		/* kernel and udev */
+	if(bind(hotplug_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "No usb hotplug events, reconnecting by polling only\n");
+		close(hotplug_fd);
+		hotplug_fd = -1;
+		return FALSE;
+	}
+	pthread_create(&thread, NULL, &hotplug_threadfunc, NULL);
+	pthread_detach(thread);
+	return TRUE;
+}
+
+/* sleep until a usb device is plugged in, but at most timeout ms */
+static void hotplug_wait(struct tether_camera *tc, int timeout) {
+	struct timespec until;
+
+	if(hotplug_fd < 0) {
+		usleep(timeout * 1000);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout / 1000;
+	until.tv_nsec += (timeout % 1000) * 1000000L;
+	if(until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&hotplug_mutex);
+	while(hotplug_generation == tc->hotplug_generation) {
+		if(pthread_cond_timedwait(&hotplug_cond, &hotplug_mutex, &until) != 0) {
+			break;
+		}
+	}
+	tc->hotplug_generation = hotplug_generation;
+	pthread_mutex_unlock(&hotplug_mutex);
+}
+
+/* take the port of the last plugged in usb device when it is our camera model
+   (and not another camera of the same model which is tethered already) */
+static void hotplug_find_port(struct tether_camera *tc) {
+	struct hotplug_device dev;
+	int j;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	dev = hotplug_last;
+	pthread_mutex_unlock(&hotplug_mutex);
+	if(dev.vendor != tc->pinned_abilities.usb_vendor || dev.product != tc->pinned_abilities.usb_product ||
+			strcmp(dev.port, tc->port) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&cameras_mutex);
+	for(j=0; j<cameras_num; j++) {
+		if(cameras[j] != tc && strcmp(cameras[j]->port, dev.port) == 0) {
+			break;
+		}
+	}
+	if(j == cameras_num) {
+		printf("%sCamera %s plugged in at port %s\n", tc->prefix, tc->pinned_abilities.model, dev.port);
+		snprintf(tc->port, sizeof(tc->port), "%s", dev.port);
+	}
+	pthread_mutex_unlock(&cameras_mutex);
+}
+
+/* look up the port of a camera of this model which is not tethered by another
+   thread. (the usb port name changes when the camera is reconnected) */
+static int camera_find_port(struct tether_camera *tc) {
+	CameraList *list;
+	const char *model, *port;
+	int i, j, found = FALSE;
+
+	gp_list_new(&list);
+	pthread_mutex_lock(&cameras_mutex);
+	if(gp_camera_autodetect(list, tc->context) >= GP_OK) {
+		for(i=0; i<gp_list_count(list) && !found; i++) {
+			gp_list_get_name(list, i, &model);
+			gp_list_get_value(list, i, &port);
+			found = (strcmp(model, tc->model) == 0 && strcmp(port, tc->port) == 0);
+		}
+		for(i=0; i<gp_list_count(list) && !found; i++) {
+			gp_list_get_name(list, i, &model);
+			gp_list_get_value(list, i, &port);
+			if(strcmp(model, tc->model) != 0) {
+				continue;
+			}
+			for(j=0; j<cameras_num; j++) {
+				if(cameras[j] != tc && strcmp(cameras[j]->port, port) == 0) {
+					break;
+				}
+			}
+			if(j == cameras_num) {
+				printf("%sCamera %s moved to port %s\n", tc->prefix, tc->model, port);
+				snprintf(tc->port, sizeof(tc->port), "%s", port);
+				found = TRUE;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cameras_mutex);
+	gp_list_free(list);
+	return found;
+}
+
+/* remember abilities and port of the camera after a successful init */
+static void camera_pin(struct tether_camera *tc) {
+	GPPortInfo portinfo;
+	char *path;
+
+	if(gp_camera_get_abilities(tc->camera, &tc->pinned_abilities) < GP_OK ||
+			gp_camera_get_port_info(tc->camera, &portinfo) < GP_OK || gp_port_info_get_path(portinfo, &path) < GP_OK) {
+		return;
+	}
+	pthread_mutex_lock(&cameras_mutex);
+	snprintf(tc->port, sizeof(tc->port), "%s", path);
+	pthread_mutex_unlock(&cameras_mutex);
+	if(!tc->pinned) {
+		printf("%sPinned camera %s at port %s\n", tc->prefix, tc->pinned_abilities.model, tc->port);
+	}
+	tc->pinned = TRUE;
+}
+
+/* init with the pinned abilities and port, which skips the autodetection.
+   (only the port list is loaded again, when the port is new) */
+static int camera_open_pinned(struct tether_camera *tc) {
+	GPPortInfo portinfo;
+	int i, retval;
+	double start = now_ms();
+
+	hotplug_find_port(tc);
+	gp_camera_free(tc->camera);
+	gp_camera_new(&tc->camera);
+
+	pthread_mutex_lock(&cameras_mutex);
+	if(port_info_list == NULL) {
+		gp_port_info_list_new(&port_info_list);
+		gp_port_info_list_load(port_info_list);
+	}
+	i = gp_port_info_list_lookup_path(port_info_list, tc->port);
+	if(i < 0) {
+		gp_port_info_list_free(port_info_list);
+		gp_port_info_list_new(&port_info_list);
+		gp_port_info_list_load(port_info_list);
+		i = gp_port_info_list_lookup_path(port_info_list, tc->port);
+	}
+	retval = (i >= 0) ? gp_port_info_list_get_info(port_info_list, i, &portinfo) : i;
+	if(retval >= GP_OK) {
+		retval = gp_camera_set_abilities(tc->camera, tc->pinned_abilities);
+	}
+	if(retval >= GP_OK) {
+		retval = gp_camera_set_port_info(tc->camera, portinfo);
+	}
+	pthread_mutex_unlock(&cameras_mutex);
+	if(retval >= GP_OK) {
+		retval = gp_camera_init(tc->camera, tc->context);
+	}
+	if(retval >= GP_OK) {
+		printf("%sCamera init at %s in %.0f ms\n", tc->prefix, tc->port, now_ms() - start);
+	}
+	return retval;
+}
+
+static int camera_open(struct tether_camera *tc) {
+	CameraAbilities abilities;
+	GPPortInfo portinfo;
+	int i, retval;
+
+	if(tc->sim != NULL) {
+		return GP_OK;
+	}
+	if(tc->pinned) {
+		if(camera_open_pinned(tc) == GP_OK) {
+			return GP_OK;
+		}
+		/* e.g. on another port which we did not see being plugged in */
+		gp_camera_free(tc->camera);
+		gp_camera_new(&tc->camera);
 	}
-	if(argc == 2) {
-		receivedir = argv[1];
+	if(tc->model[0] != '\0') {
+		if(!camera_find_port(tc)) {
+			return GP_ERROR;
+		}
+		/* start over with a fresh camera, as abilities and port can only be set before init */
+		gp_camera_free(tc->camera);
+		gp_camera_new(&tc->camera);
+
+		pthread_mutex_lock(&cameras_mutex);
+		i = gp_abilities_list_lookup_model(abilities_list, tc->model);
+		retval = (i >= 0) ? gp_abilities_list_get_abilities(abilities_list, i, &abilities) : i;
+		if(retval >= GP_OK) {
+			retval = gp_camera_set_abilities(tc->camera, abilities);
+		}
+		if(retval >= GP_OK) {
+			i = gp_port_info_list_lookup_path(port_info_list, tc->port);
+			retval = (i >= 0) ? gp_port_info_list_get_info(port_info_list, i, &portinfo) : i;
+		}
+		if(retval >= GP_OK) {
+			retval = gp_camera_set_port_info(tc->camera, portinfo);
+		}
+		pthread_mutex_unlock(&cameras_mutex);
+		if(retval < GP_OK) {
+			return retval;
+		}
+	}
+	retval = gp_camera_init(tc->camera, tc->context);
+	if(retval == GP_OK && pin_camera) {
+		camera_pin(tc);
+	}
+	return retval;
+}
+
+/* model and serial number of the connected camera, so that the delete journal
+   is not applied to another camera which gets the same prefix. without a
+   serial number (e.g. a non-ptp camera), the port has to do */
+static void camera_identify(struct tether_camera *tc) {
+	CameraAbilities abilities;
+	CameraWidget *root = NULL, *widget;
+	GPPortInfo portinfo;
+	const char *serial = NULL;
+	char *path;
+
+	if(tc->sim != NULL) {
+		snprintf(tc->identity, sizeof(tc->identity), "simulated");
+		return;
+	}
+	if(gp_camera_get_abilities(tc->camera, &abilities) < GP_OK) {
+		abilities.model[0] = '\0';
+	}
+	if(gp_camera_get_config(tc->camera, &root, tc->context) >= GP_OK &&
+			gp_widget_get_child_by_name(root, "serialnumber", &widget) >= GP_OK &&
+			gp_widget_get_value(widget, &serial) >= GP_OK && serial != NULL && serial[0] != '\0') {
+		snprintf(tc->identity, sizeof(tc->identity), "%s serial %s", abilities.model, serial);
+	} else if(gp_camera_get_port_info(tc->camera, &portinfo) >= GP_OK && gp_port_info_get_path(portinfo, &path) >= GP_OK) {
+		snprintf(tc->identity, sizeof(tc->identity), "%s port %s", abilities.model, path);
 	} else {
-		receivedir = ".";
+		snprintf(tc->identity, sizeof(tc->identity), "%s", abilities.model);
+	}
+	if(root != NULL) {
+		gp_widget_free(root);
 	}
+	tc->identity[strcspn(tc->identity, "\t\n")] = '\0';	/* the journal is tab separated */
+}
 
-	GPContext *context = gp_context_new();
-	gp_log_add_func(GP_LOG_ERROR, errordumper, NULL);
-	gp_camera_new(&camera);
+void *tether_threadfunc(void *arg) {
+	struct tether_camera *tc = (struct tether_camera *) arg;
+	int retval;
 
-	printf("Camera init.\n");
+	tc->context = gp_context_new();
+	gp_camera_new(&tc->camera);
+	trace_thread_name("tether ", tc->prefix);
+	thread_role(ROLE_USB);
+
+	printf("%sCamera init.\n", tc->prefix);
 	do {
-		retval = gp_camera_init(camera, context);
+		retval = camera_open(tc);
 		if (retval == GP_OK) {
 			break;
 		}
-		sleep(1);	// retry every second for initial camera
+		hotplug_wait(tc, 1000);	// retry every second for initial camera, or when a usb device is plugged in
 	} while(TRUE);
 
 	do {
-		camera_tether(camera, context);
+		if(deferred_delete) {
+			camera_identify(tc);
+			delete_queue_connected(&tc->deletes);
+		}
+		if(camera_settings_num > 0) {
+			camera_config_apply(tc, camera_settings, camera_settings_num);
+		}
+		camera_commands_connected(tc, TRUE);
+		camera_tether(tc);
+		camera_commands_connected(tc, FALSE);
+		camera_event_latency_report(tc, "of the last connection");
 
-		gp_camera_exit(camera, context);
+		if(tc->sim == NULL) {
+			gp_camera_exit(tc->camera, tc->context);
+		}
 
-		do {	// reconnect camera. retry every second
-			sleep(1);
-			retval = gp_camera_init(camera, context);
+		do {	// reconnect camera. retry every second, or when a usb device is plugged in
+			hotplug_wait(tc, 1000);
+			retval = camera_open(tc);
 		} while (retval != GP_OK);
 	} while (TRUE);
+	return NULL;
+}
+
+static struct tether_camera *new_tether_camera(int index, const char *prefix, const char *model, const char *port) {
+	struct tether_camera *tc = malloc(sizeof(struct tether_camera));
+	memset(tc, 0, sizeof(struct tether_camera));
+	tc->index = index;
+	tc->prefix = strdup(prefix);
+	TAILQ_INIT(&tc->commands);
+	pthread_mutex_init(&tc->commands_mutex, NULL);
+	pthread_cond_init(&tc->commands_cond, NULL);
+	snprintf(tc->model, sizeof(tc->model), "%s", model);
+	snprintf(tc->port, sizeof(tc->port), "%s", port);
+	if(deferred_delete) {
+		delete_queue_init(&tc->deletes, receivedir, tc->prefix, tc->identity);
+	}
+	if(catch_up) {
+		journal_init(&tc->journal, receivedir, tc->prefix);
+	}
+	return tc;
+}
+
+/* wait until at least one camera is connected, and set up all connected cameras */
+static void detect_cameras(void) {
+	GPContext *context = gp_context_new();
+	CameraList *list;
+	const char *model, *port;
+	struct tether_camera **found;
+	char prefix[16];
+	int i, num;
+
+	gp_abilities_list_new(&abilities_list);
+	gp_abilities_list_load(abilities_list, context);
+	gp_port_info_list_new(&port_info_list);
+	gp_port_info_list_load(port_info_list);
+
+	printf("Camera detection.\n");
+	gp_list_new(&list);
+	while(gp_camera_autodetect(list, context) < GP_OK || gp_list_count(list) <= 0) {
+		sleep(1);
+		gp_list_reset(list);
+	}
+	num = gp_list_count(list);
+	found = malloc(num * sizeof(struct tether_camera *));
+	for(i=0; i<num; i++) {
+		gp_list_get_name(list, i, &model);
+		gp_list_get_value(list, i, &port);
+		sprintf(prefix, "cam%d-", i+1);
+		printf("Found camera %s at %s, using filename prefix %s\n", model, port, prefix);
+		found[i] = new_tether_camera(i, prefix, model, port);
+	}
+	cameras_publish(found, num);
+	gp_list_free(list);
+	gp_context_unref(context);
+}
+
+int main(int argc, char **argv) {
+	boolean show_usage = FALSE;
+	char *simulation_script = NULL;
+	char *bench_sniff_file = NULL;
+	int n;
+
+	receivedir = NULL;
+	for(n=1; n<argc; n++) {
+		if(strcmp(argv[n],"--deferred-delete") == 0) {
+			deferred_delete = TRUE;
+		}
+		else if(strcmp(argv[n],"--delete-batch") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0) {
+				delete_batch_size = atoi(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--cpus") == 0) {
+			n++;
+			if(n>=argc || !parse_thread_cpus(argv[n])) {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--sched") == 0) {
+			n++;
+			if(n>=argc || !parse_thread_sched(argv[n])) {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--degrade-backlog") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0) {
+				degrade_backlog = atoi(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--camera-config") == 0) {
+			n++;
+			if(n<argc && strcmp(argv[n], "latency") == 0 && camera_settings_num < CAMERA_SETTINGS_MAX) {
+				/* keep the shots in the camera ram, instead of writing them
+				   to the card before they are announced */
+				parse_camera_setting("capturetarget=Internal RAM", &camera_settings[camera_settings_num++]);
+			} else if(n>=argc || camera_settings_num >= CAMERA_SETTINGS_MAX || !parse_camera_setting(argv[n], &camera_settings[camera_settings_num++])) {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--command-socket") == 0) {
+			n++;
+			if(n<argc) {
+				command_socket = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--live-view") == 0) {
+			n++;
+			if(n<argc && atof(argv[n]) > 0) {
+				live_view_fps = atof(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--live-view-size") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0 && atoi(argv[n]) <= LIVE_VIEW_SIZE_MAX) {
+				live_view_size = atoi(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--live-view-shm") == 0) {
+			n++;
+			if(n<argc) {
+				live_view_shm = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--jpeg-threads") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0) {
+				jpeg_threads = atoi(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--jpeg-full") == 0) {
+			n++;
+			if(n<argc && strcmp(argv[n], "block") == 0) {
+				jpeg_full_policy = JPEG_FULL_BLOCK;
+			} else if(n<argc && strcmp(argv[n], "spill") == 0) {
+				jpeg_full_policy = JPEG_FULL_SPILL;
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--optimize-jpeg") == 0) {
+			n++;
+			if(n<argc && strcmp(argv[n], "huffman") == 0) {
+				optimize_mode = OPTIMIZE_HUFFMAN;
+			} else if(n<argc && strcmp(argv[n], "progressive") == 0) {
+				optimize_mode = OPTIMIZE_PROGRESSIVE;
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--optimize-dir") == 0) {
+			n++;
+			if(n<argc) {
+				optimize_dir = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--mirror") == 0) {
+			n++;
+			if(n<argc) {
+				mirror_add(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--write-behind") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0) {
+				write_behind_window = (uint64_t) atoi(argv[n]) * 1024 * 1024;
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--io-uring") == 0) {
+			io_uring_writes = TRUE;
+		}
+		else if(strcmp(argv[n],"--raw-preview") == 0) {
+			raw_preview = TRUE;
+		}
+		else if(strcmp(argv[n],"--pin-camera") == 0) {
+			pin_camera = TRUE;
+		}
+		else if(strcmp(argv[n],"--catch-up") == 0) {
+			catch_up = TRUE;
+		}
+		else if(strcmp(argv[n],"--skip-duplicates") == 0) {
+			skip_duplicates = TRUE;
+		}
+		else if(strcmp(argv[n],"--multi-camera") == 0) {
+			multi_camera = TRUE;
+		}
+		else if(strcmp(argv[n],"--derivative-dir") == 0) {
+			n++;
+			if(n<argc) {
+				derivativedir = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--derivative-size") == 0) {
+			n++;
+			if(n<argc && atoi(argv[n]) > 0) {
+				derivative_size = atoi(argv[n]);
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--notify-socket") == 0) {
+			n++;
+			if(n<argc) {
+				notify_socket = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--metrics-socket") == 0) {
+			n++;
+			if(n<argc) {
+				metrics_socket = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--metrics-file") == 0) {
+			n++;
+			if(n<argc) {
+				metrics_file = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--trace") == 0) {
+			n++;
+			if(n<argc) {
+				trace_file = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--checksum-manifest") == 0) {
+			n++;
+			if(n<argc) {
+				checksum_manifest = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--bench-sniff") == 0) {
+			n++;
+			if(n<argc) {
+				bench_sniff_file = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--simulate") == 0) {
+			n++;
+			if(n<argc) {
+				simulation_script = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(strcmp(argv[n],"--preview-dir") == 0) {
+			n++;
+			if(n<argc) {
+				previewdir = argv[n];
+			} else {
+				show_usage = TRUE;
+			}
+		}
+		else if(argv[n][0] == '-' || receivedir != NULL) {
+			show_usage = TRUE;
+		}
+		else {
+			receivedir = argv[n];
+		}
+	}
+	if(simulation_script != NULL && multi_camera) {
+		show_usage = TRUE;
+	}
+	if(optimize_dir != NULL && optimize_mode == 0) {
+		show_usage = TRUE;
+	}
+	if(io_uring_writes && write_behind_window > 0) {
+		/* the writes are still in the ring when sync_file_range would start their writeback */
+		show_usage = TRUE;
+	}
+	if(live_view_fps > 0 && multi_camera) {
+		/* one live view for one screen */
+		show_usage = TRUE;
+	}
+	if(show_usage) {
+		printf("Usage: %s [--multi-camera | --simulate SCRIPT | --bench-sniff FILE] [--preview-dir DIR] [--derivative-dir DIR] [--derivative-size N] [--mirror DIR] [--live-view FPS] [--live-view-size N] [--live-view-shm NAME] [--jpeg-threads N] [--jpeg-full block|spill] [--degrade-backlog N] [--optimize-jpeg huffman|progressive] [--optimize-dir DIR] [--io-uring | --write-behind MB] [--raw-preview] [--checksum-manifest FILE] [--notify-socket PATH] [--camera-config NAME=VALUE|latency] [--command-socket PATH] [--metrics-socket PATH] [--metrics-file FILE] [--trace FILE] [--cpus ROLE=CPUS] [--sched ROLE=POLICY] [--pin-camera] [--catch-up] [--skip-duplicates] [--deferred-delete] [--delete-batch N] <receivepath>\n", argv[0]);
+		exit(1);
+	}
+	if(receivedir == NULL) {
+		receivedir = ".";
+	}
+	if(bench_sniff_file != NULL) {
+		exit(bench_sniff(bench_sniff_file) ? 0 : 1);
+	}
+	/* a metrics scraper or notify client which goes away must not take the
+	   capture down with it: the write fails with EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+	if(skip_duplicates) {
+		dedup_init(receivedir);
+	}
+
+	if(simulation_script != NULL) {
+		simulated_camera = simulated_camera_new(simulation_script);
+		if(simulated_camera == NULL) {
+			exit(1);
+		}
+	}
+	if(trace_file != NULL) {
+		trace_start();
+	}
+	if(notify_socket != NULL && !notify_start(notify_socket)) {
+		exit(1);
+	}
+	if(command_socket != NULL) {
+		if(!command_start(command_socket)) {
+			exit(1);
+		}
+		camera_commands_used = TRUE;
+	}
+	if(!metrics_start()) {
+		exit(1);
+	}
+
+	if(pin_camera && simulated_camera == NULL) {
+		hotplug_start();
+	}
+	if(thread_policies_used) {
+		sched_getaffinity(0, sizeof(cpu_set_t), &default_cpus);
+		default_nice = getpriority(PRIO_PROCESS, 0);
+	}
+#ifndef HAVE_IO_URING
+	if(io_uring_writes) {
+		fprintf(stderr, "No io_uring support compiled in, using write()\n");
+	}
+#endif
+	mirror_start();
+	if(live_view_fps > 0 && !live_view_start()) {
+		exit(1);
+	}
+	if(degrade_backlog > 0) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &rotation_threadfunc, NULL);
+		pthread_detach(thread);
+	}
+	if(optimize_mode != 0) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &optimize_threadfunc, NULL);
+		pthread_detach(thread);
+	}
+
+	gp_log_add_func(GP_LOG_ERROR, errordumper, NULL);
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	work_pool_start(&workers, n > 0 ? n : 1);
+	jpeg_pool_start(&jpeg_pool, jpeg_threads);
+
+	if(multi_camera) {
+		detect_cameras();
+		for(n=0; n<cameras_num; n++) {
+			pthread_create(&cameras[n]->thread, NULL, &tether_threadfunc, cameras[n]);
+		}
+		for(n=0; n<cameras_num; n++) {
+			pthread_join(cameras[n]->thread, NULL);
+		}
+	} else {
+		/* just the one camera which gp_camera_init autodetects */
+		struct tether_camera **found = malloc(sizeof(struct tether_camera *));
+		found[0] = new_tether_camera(0, "", "", "");
+		found[0]->sim = simulated_camera;
+		cameras_publish(found, 1);
+		tether_threadfunc(cameras[0]);
+	}
 	return 0;
 }
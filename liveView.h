@@ -0,0 +1,52 @@
+/*
+ * Shared memory layout of the live view of continuousCameraCapture
+ * (--live-view), for the display process.
+ *
+ * The shared memory object (shm_open name, default
+ * /continuousCameraCapture.liveview, i.e. a file in /dev/shm) starts with
+ * a struct live_view_header, followed by the pixels of LIVE_VIEW_SLOTS
+ * frames, at the offsets given in the slots. Frame n (counting from 1) is
+ * written to slot n % LIVE_VIEW_SLOTS. The pixels are rows of
+ * width * components bytes (RGB, or grayscale), top down.
+ *
+ * Reading the newest frame, without any locking:
+ *   n = latest;  s = &slot[n % LIVE_VIEW_SLOTS];
+ *   if(s->seq == n) {
+ *     copy the pixels;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     if(s->seq == n) the copy is good;
+ *   }
+ * with acquire loads (e.g. __atomic_load_n(..., __ATOMIC_ACQUIRE)) of latest
+ * and the first seq, and a relaxed load of the second seq. The fence keeps
+ * the pixel copy before the second check (an acquire load alone would not,
+ * e.g. on ARM). While a slot is rewritten, its seq is 0. A display which is
+ * too slow only misses frames, it never holds up continuousCameraCapture.
+ */
+#ifndef LIVE_VIEW_H
+#define LIVE_VIEW_H
+
+#include <stdint.h>
+
+#define LIVE_VIEW_MAGIC 0x4c564557	/* "LVEW" */
+#define LIVE_VIEW_SLOTS 4
+#define LIVE_VIEW_DEFAULT_SHM "/continuousCameraCapture.liveview"
+
+struct live_view_slot {
+	uint64_t seq;		/* the frame number, 0 while being written */
+	uint32_t width;
+	uint32_t height;
+	uint32_t components;
+	uint32_t offset;	/* of the pixels, from the start of the shared memory */
+	double captured_ms;	/* CLOCK_MONOTONIC */
+};
+
+struct live_view_header {
+	uint32_t magic;
+	uint32_t slot_size;	/* room for the pixels of one frame */
+	uint64_t latest;	/* the newest complete frame, 0 before the first */
+	uint64_t frames;	/* frames captured from the camera */
+	uint64_t dropped;	/* frames which were due but not captured, or not decoded in time */
+	struct live_view_slot slot[LIVE_VIEW_SLOTS];
+};
+
+#endif
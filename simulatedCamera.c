@@ -0,0 +1,274 @@
+/*
+ * Simulated camera for continuousCameraCapture, see simulatedCamera.h
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+#include <gphoto2/gphoto2.h>
+#include "simulatedCamera.h"
+
+#define SIMULATED_FOLDER "/store_00010001/DCIM/100SIMUL"
+#define SIMULATED_CHUNK_SIZE (64 * 1024)
+
+struct simulated_event {
+	double at_ms;		/* relative to the start of the simulation */
+	char name[128];
+	char sample[128];
+};
+
+struct simulated_camera {
+	char *dir;
+	double bandwidth;	/* bytes per ms */
+	double latency_ms;
+	struct simulated_event *events;
+	int events_num;
+	int next_event;
+	double start_ms;
+	char *live_view;	/* sample frame for the live view, NULL: not supported */
+	long live_view_size;
+	char *trigger;		/* sample file of a triggered capture, NULL: not supported */
+	double trigger_lag_ms;	/* from the trigger to the FILE_ADDED event */
+	int triggered;
+};
+
+static double sim_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void sim_sleep_until(double until_ms) {
+	double ms = until_ms - sim_now_ms();
+	if(ms > 0) {
+		usleep((useconds_t) (ms * 1000.0));
+	}
+}
+
+struct simulated_camera *simulated_camera_new(const char *script) {
+	struct simulated_camera *sim;
+	char line[1024], arg[1024], sample[1024];
+	char *scriptcopy;
+	double value;
+	FILE *f;
+	int lineno = 0;
+
+	f = fopen(script, "r");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot read simulation script %s\n", script);
+		return NULL;
+	}
+	sim = malloc(sizeof(struct simulated_camera));
+	scriptcopy = strdup(script);
+	sim->dir = strdup(dirname(scriptcopy));
+	free(scriptcopy);
+	sim->bandwidth = 30 * 1024 * 1024 / 1000.0;
+	sim->latency_ms = 5;
+	sim->events = NULL;
+	sim->events_num = 0;
+	sim->next_event = 0;
+	sim->start_ms = -1;
+	sim->live_view = NULL;
+	sim->live_view_size = 0;
+	sim->trigger = NULL;
+	sim->trigger_lag_ms = 0;
+	sim->triggered = 0;
+
+	while(fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if(sscanf(line, " dir %1023s", arg) == 1) {
+			free(sim->dir);
+			if(arg[0] == '/') {
+				sim->dir = strdup(arg);
+			} else {
+				scriptcopy = strdup(script);
+				sim->dir = malloc(strlen(script) + strlen(arg) + 2);
+				sprintf(sim->dir, "%s/%s", dirname(scriptcopy), arg);
+				free(scriptcopy);
+			}
+		} else if(sscanf(line, " bandwidth %lf", &value) == 1) {
+			sim->bandwidth = value * 1024 * 1024 / 1000.0;
+		} else if(sscanf(line, " latency %lf", &value) == 1) {
+			sim->latency_ms = value;
+		} else if(sscanf(line, " liveview %1023s", sample) == 1) {
+			free(sim->live_view);
+			sim->live_view = strdup(sample);
+		} else if(sscanf(line, " trigger %1023s", sample) == 1) {
+			free(sim->trigger);
+			sim->trigger = strdup(sample);
+			if(sscanf(line, " trigger %*s %lf", &value) == 1) {
+				sim->trigger_lag_ms = value;
+			}
+		} else if(sscanf(line, " %lf %127s", &value, arg) == 2) {
+			if(sscanf(line, " %*f %*s %127s", sample) != 1) {
+				strcpy(sample, arg);
+			}
+			sim->events = realloc(sim->events, (sim->events_num+1) * sizeof(struct simulated_event));
+			sim->events[sim->events_num].at_ms = value;
+			strcpy(sim->events[sim->events_num].name, arg);
+			strcpy(sim->events[sim->events_num].sample, sample);
+			sim->events_num++;
+		} else if(strspn(line, " \t") != strlen(line)) {
+			fprintf(stderr, "%s:%d: cannot parse \"%s\"\n", script, lineno, line);
+		}
+	}
+	fclose(f);
+	printf("Simulated camera: %d events, samples from %s, %.1f MB/s, %.1f ms latency\n",
+		sim->events_num, sim->dir, sim->bandwidth * 1000.0 / 1024 / 1024, sim->latency_ms);
+	return sim;
+}
+
+int simulated_camera_wait_for_event(struct simulated_camera *sim, int timeout, CameraEventType *eventtype, void **eventdata, double *event_ms) {
+	double now, due;
+	CameraFilePath *path;
+
+	now = sim_now_ms();
+	if(sim->start_ms < 0) {
+		sim->start_ms = now;
+	}
+	sim_sleep_until(now + sim->latency_ms);
+	*eventdata = NULL;
+	if(sim->next_event >= sim->events_num) {
+		sim_sleep_until(now + timeout);
+		*eventtype = GP_EVENT_TIMEOUT;
+		return GP_OK;
+	}
+	due = sim->start_ms + sim->events[sim->next_event].at_ms;
+	if(due > now + timeout) {
+		sim_sleep_until(now + timeout);
+		*eventtype = GP_EVENT_TIMEOUT;
+		return GP_OK;
+	}
+	sim_sleep_until(due);
+	path = malloc(sizeof(CameraFilePath));
+	strcpy(path->folder, SIMULATED_FOLDER);
+	strcpy(path->name, sim->events[sim->next_event].name);
+	sim->next_event++;
+	*eventtype = GP_EVENT_FILE_ADDED;
+	*eventdata = path;
+	*event_ms = due;	/* when the "shutter" fired, not when we noticed */
+	return GP_OK;
+}
+
+static const char *sim_sample(struct simulated_camera *sim, const char *file) {
+	int i;
+
+	for(i=0; i<sim->events_num; i++) {
+		if(strcmp(sim->events[i].name, file) == 0) {
+			return sim->events[i].sample;
+		}
+	}
+	return file;
+}
+
+int simulated_camera_file_get(struct simulated_camera *sim, const char *folder, const char *file, CameraFileType type, CameraFile *camera_file) {
+	char buf[SIMULATED_CHUNK_SIZE];
+	const char *sample;
+	char *filename;
+	double start;
+	size_t c, total = 0;
+	int retval = GP_OK;
+	FILE *f;
+
+	if(type != GP_FILE_TYPE_NORMAL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	sample = sim_sample(sim, file);
+	filename = malloc(strlen(sim->dir) + strlen(sample) + 2);
+	sprintf(filename, "%s/%s", sim->dir, sample);
+	f = fopen(filename, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot read sample file %s\n", filename);
+		free(filename);
+		return GP_ERROR;
+	}
+	start = sim_now_ms() + sim->latency_ms;
+	while((c = fread(buf, 1, sizeof(buf), f)) > 0) {
+		total += c;
+		sim_sleep_until(start + total / sim->bandwidth);
+		retval = gp_file_append(camera_file, buf, c);
+		if(retval != GP_OK) {
+			break;
+		}
+	}
+	fclose(f);
+	free(filename);
+	return retval;
+}
+
+/* the same sample frame every time, with the latency and bandwidth of a download */
+int simulated_camera_capture_preview(struct simulated_camera *sim, CameraFile *camera_file) {
+	char *filename, *data;
+	double start;
+	FILE *f;
+
+	if(sim->live_view == NULL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	filename = malloc(strlen(sim->dir) + strlen(sim->live_view) + 2);
+	sprintf(filename, "%s/%s", sim->dir, sim->live_view);
+	f = fopen(filename, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "Cannot read sample file %s\n", filename);
+		free(filename);
+		return GP_ERROR;
+	}
+	fseek(f, 0, SEEK_END);
+	sim->live_view_size = ftell(f);
+	rewind(f);
+	data = malloc(sim->live_view_size);
+	start = sim_now_ms() + sim->latency_ms;
+	if(fread(data, 1, sim->live_view_size, f) != sim->live_view_size) {
+		sim->live_view_size = 0;
+	}
+	fclose(f);
+	free(filename);
+	sim_sleep_until(start + sim->live_view_size / sim->bandwidth);
+	gp_file_append(camera_file, data, sim->live_view_size);
+	free(data);
+	return GP_OK;
+}
+
+/* a new event for the triggered photo, in order among the scripted ones */
+int simulated_camera_trigger_capture(struct simulated_camera *sim) {
+	const char *ext;
+	double at_ms;
+	int i;
+
+	if(sim->trigger == NULL) {
+		return GP_ERROR_NOT_SUPPORTED;
+	}
+	sim_sleep_until(sim_now_ms() + sim->latency_ms);
+	if(sim->start_ms < 0) {
+		sim->start_ms = sim_now_ms();
+	}
+	at_ms = sim_now_ms() - sim->start_ms + sim->trigger_lag_ms;
+	sim->events = realloc(sim->events, (sim->events_num+1) * sizeof(struct simulated_event));
+	for(i=sim->events_num; i>sim->next_event && sim->events[i-1].at_ms > at_ms; i--) {
+		sim->events[i] = sim->events[i-1];
+	}
+	ext = strrchr(sim->trigger, '.');
+	sim->triggered++;
+	snprintf(sim->events[i].name, sizeof(sim->events[i].name), "TRIG%04d%s", sim->triggered, ext != NULL ? ext : "");
+	snprintf(sim->events[i].sample, sizeof(sim->events[i].sample), "%s", sim->trigger);
+	sim->events[i].at_ms = at_ms;
+	sim->events_num++;
+	return GP_OK;
+}
+
+int simulated_camera_file_delete(struct simulated_camera *sim, const char *folder, const char *file) {
+	sim_sleep_until(sim_now_ms() + sim->latency_ms);
+	return GP_OK;
+}
+
+int simulated_camera_events(struct simulated_camera *sim) {
+	return sim->events_num;
+}
+
+int simulated_camera_finished(struct simulated_camera *sim) {
+	return sim->next_event >= sim->events_num;
+}
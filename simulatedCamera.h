@@ -0,0 +1,36 @@
+/*
+ * Simulated camera for continuousCameraCapture, replaying a script of
+ * FILE_ADDED events with sample files from disk, throttled to a USB-like
+ * bandwidth and request latency.
+ *
+ * Script format, one entry per line ('#' starts a comment):
+ *   dir <path>          directory with the sample files (relative to the script)
+ *   bandwidth <MB/s>    transfer speed for file downloads (default 30)
+ *   latency <ms>        round trip time of every camera request (default 5)
+ *   liveview <sample>   frame for gp_camera_capture_preview (default: none,
+ *                       i.e. live view is not supported)
+ *   trigger <sample> [<ms>]
+ *                       gp_camera_trigger_capture announces a new file with
+ *                       the contents of <sample>, <ms> later (default: none,
+ *                       i.e. triggering is not supported)
+ *   <ms> <name> [<sample>]
+ *                       the camera announces the file <name> <ms> after the start,
+ *                       with the contents of <sample> (default: <name>) from dir
+ */
+#ifndef SIMULATED_CAMERA_H
+#define SIMULATED_CAMERA_H
+
+#include <gphoto2/gphoto2.h>
+
+struct simulated_camera;
+
+struct simulated_camera *simulated_camera_new(const char *script);
+int simulated_camera_wait_for_event(struct simulated_camera *sim, int timeout, CameraEventType *eventtype, void **eventdata, double *event_ms);
+int simulated_camera_file_get(struct simulated_camera *sim, const char *folder, const char *file, CameraFileType type, CameraFile *camera_file);
+int simulated_camera_capture_preview(struct simulated_camera *sim, CameraFile *camera_file);
+int simulated_camera_trigger_capture(struct simulated_camera *sim);
+int simulated_camera_file_delete(struct simulated_camera *sim, const char *folder, const char *file);
+int simulated_camera_events(struct simulated_camera *sim);
+int simulated_camera_finished(struct simulated_camera *sim);
+
+#endif